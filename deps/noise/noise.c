@@ -28,6 +28,22 @@ SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 
+/* keep a * b + c as two roundings so the batched and scalar paths agree */
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NOISE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NOISE_NEON
+#endif
+
 #define F2 0.3660254037844386f
 #define G2 0.21132486540518713f
 #define F3 (1.0f / 3.0f)
@@ -109,8 +125,15 @@ static unsigned char PERM[] = {
     128, 195,  78,  66, 215,  61, 156, 180
 };
 
+static unsigned int seeds;
+
+unsigned int seed_count(void) {
+    return seeds;
+}
+
 void seed(unsigned int x) {
    int i;
+    seeds++;
     srand(x);
     for (i = 0; i < 256; i++)
         PERM[i] = i;
@@ -273,3 +296,271 @@ float simplex3(
     }
     return (1 + total / max) / 2;
 }
+
+/* Batched versions of simplex2 and simplex3. Four points are evaluated at a
+   time with SSE2 or NEON, the rest with the scalar code above. Every lane
+   performs the same float operations in the same order as the scalar code,
+   so results are bit-identical. */
+
+#if defined(NOISE_SSE2)
+
+typedef __m128 vfloat;
+#define VF_SET(a) _mm_set1_ps(a)
+#define VF_LOAD(p) _mm_loadu_ps(p)
+#define VF_STORE(p, v) _mm_storeu_ps(p, v)
+#define VF_ADD(a, b) _mm_add_ps(a, b)
+#define VF_SUB(a, b) _mm_sub_ps(a, b)
+#define VF_MUL(a, b) _mm_mul_ps(a, b)
+#define VF_DIV(a, b) _mm_div_ps(a, b)
+#define VF_GT(a, b) _mm_cmpgt_ps(a, b)
+#define VF_AND(a, b) _mm_and_ps(a, b)
+#define VF_TRUNC(a) _mm_cvtepi32_ps(_mm_cvttps_epi32(a))
+#define VF_STORE_INT(p, v) \
+    _mm_storeu_si128((__m128i *)(p), _mm_cvttps_epi32(v))
+
+#elif defined(NOISE_NEON)
+
+typedef float32x4_t vfloat;
+#define VF_SET(a) vdupq_n_f32(a)
+#define VF_LOAD(p) vld1q_f32(p)
+#define VF_STORE(p, v) vst1q_f32(p, v)
+#define VF_ADD(a, b) vaddq_f32(a, b)
+#define VF_SUB(a, b) vsubq_f32(a, b)
+#define VF_MUL(a, b) vmulq_f32(a, b)
+#define VF_DIV(a, b) vdivq_f32(a, b)
+#define VF_GT(a, b) vreinterpretq_f32_u32(vcgtq_f32(a, b))
+#define VF_AND(a, b) vreinterpretq_f32_u32(vandq_u32( \
+    vreinterpretq_u32_f32(a), vreinterpretq_u32_f32(b)))
+#define VF_TRUNC(a) vcvtq_f32_s32(vcvtq_s32_f32(a))
+#define VF_STORE_INT(p, v) vst1q_s32(p, vcvtq_s32_f32(v))
+
+#endif
+
+#ifdef VF_SET
+
+// floorf for |a| < 2^31, which covers every coordinate we feed in
+static vfloat vf_floor(vfloat a) {
+    vfloat t = VF_TRUNC(a);
+    return VF_SUB(t, VF_AND(VF_GT(t, a), VF_SET(1.0f)));
+}
+
+static vfloat noise2_4(vfloat x, vfloat y) {
+    int c, l;
+    int I[4], J[4];
+    float i1[4], j1[4];
+    float gx[3][4], gy[3][4];
+    vfloat xx[3], yy[3], total;
+    vfloat one = VF_SET(1.0f);
+    vfloat s = VF_MUL(VF_ADD(x, y), VF_SET(F2));
+    vfloat i = vf_floor(VF_ADD(x, s));
+    vfloat j = vf_floor(VF_ADD(y, s));
+    vfloat t = VF_MUL(VF_ADD(i, j), VF_SET(G2));
+    vfloat vi1, vj1;
+
+    xx[0] = VF_SUB(x, VF_SUB(i, t));
+    yy[0] = VF_SUB(y, VF_SUB(j, t));
+
+    vi1 = VF_AND(VF_GT(xx[0], yy[0]), one);
+    vj1 = VF_SUB(one, vi1);
+    VF_STORE(i1, vi1);
+    VF_STORE(j1, vj1);
+
+    xx[2] = VF_SUB(VF_ADD(xx[0], VF_SET(G2 * 2.0f)), one);
+    yy[2] = VF_SUB(VF_ADD(yy[0], VF_SET(G2 * 2.0f)), one);
+    xx[1] = VF_ADD(VF_SUB(xx[0], vi1), VF_SET(G2));
+    yy[1] = VF_ADD(VF_SUB(yy[0], vj1), VF_SET(G2));
+
+    VF_STORE_INT(I, i);
+    VF_STORE_INT(J, j);
+    for (l = 0; l < 4; l++) {
+        int g[3];
+        int a = (int)i1[l];
+        int b = (int)j1[l];
+        I[l] &= 255;
+        J[l] &= 255;
+        g[0] = PERM[I[l] + PERM[J[l]]] % 12;
+        g[1] = PERM[I[l] + a + PERM[J[l] + b]] % 12;
+        g[2] = PERM[I[l] + 1 + PERM[J[l] + 1]] % 12;
+        for (c = 0; c <= 2; c++) {
+            gx[c][l] = GRAD3[g[c]][0];
+            gy[c][l] = GRAD3[g[c]][1];
+        }
+    }
+
+    total = VF_SET(0.0f);
+    for (c = 0; c <= 2; c++) {
+        vfloat f = VF_SUB(
+            VF_SUB(VF_SET(0.5f), VF_MUL(xx[c], xx[c])),
+            VF_MUL(yy[c], yy[c]));
+        vfloat d = VF_ADD(
+            VF_MUL(VF_LOAD(gx[c]), xx[c]),
+            VF_MUL(VF_LOAD(gy[c]), yy[c]));
+        vfloat n = VF_MUL(VF_MUL(VF_MUL(VF_MUL(f, f), f), f), d);
+        n = VF_AND(VF_GT(f, VF_SET(0.0f)), n);
+        total = c ? VF_ADD(total, n) : n;
+    }
+    return VF_MUL(total, VF_SET(70.0f));
+}
+
+static vfloat noise3_4(vfloat x, vfloat y, vfloat z) {
+    int c, l;
+    int I[4], J[4], K[4];
+    float p0[3][4];
+    float o1[3][4], o2[3][4];
+    float gr[4][3][4];
+    vfloat pos[4][3], total;
+    vfloat s = VF_MUL(VF_ADD(VF_ADD(x, y), z), VF_SET(F3));
+    vfloat i = vf_floor(VF_ADD(x, s));
+    vfloat j = vf_floor(VF_ADD(y, s));
+    vfloat k = vf_floor(VF_ADD(z, s));
+    vfloat t = VF_MUL(VF_ADD(VF_ADD(i, j), k), VF_SET(G3));
+
+    pos[0][0] = VF_SUB(x, VF_SUB(i, t));
+    pos[0][1] = VF_SUB(y, VF_SUB(j, t));
+    pos[0][2] = VF_SUB(z, VF_SUB(k, t));
+    for (c = 0; c <= 2; c++) {
+        VF_STORE(p0[c], pos[0][c]);
+    }
+
+    VF_STORE_INT(I, i);
+    VF_STORE_INT(J, j);
+    VF_STORE_INT(K, k);
+    for (l = 0; l < 4; l++) {
+        int a[3], b[3], g[4];
+        if (p0[0][l] >= p0[1][l]) {
+            if (p0[1][l] >= p0[2][l]) {
+                ASSIGN(a, 1, 0, 0);
+                ASSIGN(b, 1, 1, 0);
+            } else if (p0[0][l] >= p0[2][l]) {
+                ASSIGN(a, 1, 0, 0);
+                ASSIGN(b, 1, 0, 1);
+            } else {
+                ASSIGN(a, 0, 0, 1);
+                ASSIGN(b, 1, 0, 1);
+            }
+        } else {
+            if (p0[1][l] < p0[2][l]) {
+                ASSIGN(a, 0, 0, 1);
+                ASSIGN(b, 0, 1, 1);
+            } else if (p0[0][l] < p0[2][l]) {
+                ASSIGN(a, 0, 1, 0);
+                ASSIGN(b, 0, 1, 1);
+            } else {
+                ASSIGN(a, 0, 1, 0);
+                ASSIGN(b, 1, 1, 0);
+            }
+        }
+        I[l] &= 255;
+        J[l] &= 255;
+        K[l] &= 255;
+        g[0] = PERM[I[l] + PERM[J[l] + PERM[K[l]]]] % 12;
+        g[1] = PERM[I[l] + a[0] + PERM[J[l] + a[1] + PERM[a[2] + K[l]]]] % 12;
+        g[2] = PERM[I[l] + b[0] + PERM[J[l] + b[1] + PERM[b[2] + K[l]]]] % 12;
+        g[3] = PERM[I[l] + 1 + PERM[J[l] + 1 + PERM[K[l] + 1]]] % 12;
+        for (c = 0; c <= 2; c++) {
+            int m;
+            o1[c][l] = a[c];
+            o2[c][l] = b[c];
+            for (m = 0; m <= 3; m++) {
+                gr[m][c][l] = GRAD3[g[m]][c];
+            }
+        }
+    }
+
+    for (c = 0; c <= 2; c++) {
+        pos[3][c] = VF_ADD(
+            VF_SUB(pos[0][c], VF_SET(1.0f)), VF_SET(3.0f * G3));
+        pos[2][c] = VF_ADD(
+            VF_SUB(pos[0][c], VF_LOAD(o2[c])), VF_SET(2.0f * G3));
+        pos[1][c] = VF_ADD(
+            VF_SUB(pos[0][c], VF_LOAD(o1[c])), VF_SET(G3));
+    }
+
+    total = VF_SET(0.0f);
+    for (c = 0; c <= 3; c++) {
+        vfloat f = VF_SUB(VF_SUB(VF_SUB(
+            VF_SET(0.6f), VF_MUL(pos[c][0], pos[c][0])),
+            VF_MUL(pos[c][1], pos[c][1])),
+            VF_MUL(pos[c][2], pos[c][2]));
+        vfloat d = VF_ADD(VF_ADD(
+            VF_MUL(pos[c][0], VF_LOAD(gr[c][0])),
+            VF_MUL(pos[c][1], VF_LOAD(gr[c][1]))),
+            VF_MUL(pos[c][2], VF_LOAD(gr[c][2])));
+        vfloat n = VF_MUL(VF_MUL(VF_MUL(VF_MUL(f, f), f), f), d);
+        n = VF_AND(VF_GT(f, VF_SET(0.0f)), n);
+        total = c ? VF_ADD(total, n) : n;
+    }
+    return VF_MUL(total, VF_SET(32.0f));
+}
+
+#endif
+
+void simplex2_batch(
+    const float *x, const float *y, float *result, int count,
+    int octaves, float persistence, float lacunarity)
+{
+    int n = 0;
+#ifdef VF_SET
+    for (; n + 4 <= count; n += 4) {
+        vfloat vx = VF_LOAD(x + n);
+        vfloat vy = VF_LOAD(y + n);
+        float freq = 1.0f;
+        float amp = 1.0f;
+        float max = 1.0f;
+        vfloat total = noise2_4(vx, vy);
+        int i;
+        for (i = 1; i < octaves; i++) {
+            vfloat vfreq;
+            freq *= lacunarity;
+            amp *= persistence;
+            max += amp;
+            vfreq = VF_SET(freq);
+            total = VF_ADD(total, VF_MUL(
+                noise2_4(VF_MUL(vx, vfreq), VF_MUL(vy, vfreq)),
+                VF_SET(amp)));
+        }
+        VF_STORE(result + n, VF_DIV(
+            VF_ADD(VF_SET(1.0f), VF_DIV(total, VF_SET(max))),
+            VF_SET(2.0f)));
+    }
+#endif
+    for (; n < count; n++) {
+        result[n] = simplex2(x[n], y[n], octaves, persistence, lacunarity);
+    }
+}
+
+void simplex3_batch(
+    const float *x, const float *y, const float *z, float *result, int count,
+    int octaves, float persistence, float lacunarity)
+{
+    int n = 0;
+#ifdef VF_SET
+    for (; n + 4 <= count; n += 4) {
+        vfloat vx = VF_LOAD(x + n);
+        vfloat vy = VF_LOAD(y + n);
+        vfloat vz = VF_LOAD(z + n);
+        float freq = 1.0f;
+        float amp = 1.0f;
+        float max = 1.0f;
+        vfloat total = noise3_4(vx, vy, vz);
+        int i;
+        for (i = 1; i < octaves; i++) {
+            vfloat vfreq;
+            freq *= lacunarity;
+            amp *= persistence;
+            max += amp;
+            vfreq = VF_SET(freq);
+            total = VF_ADD(total, VF_MUL(noise3_4(
+                VF_MUL(vx, vfreq), VF_MUL(vy, vfreq), VF_MUL(vz, vfreq)),
+                VF_SET(amp)));
+        }
+        VF_STORE(result + n, VF_DIV(
+            VF_ADD(VF_SET(1.0f), VF_DIV(total, VF_SET(max))),
+            VF_SET(2.0f)));
+    }
+#endif
+    for (; n < count; n++) {
+        result[n] = simplex3(
+            x[n], y[n], z[n], octaves, persistence, lacunarity);
+    }
+}
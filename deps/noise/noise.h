@@ -28,6 +28,8 @@ SOFTWARE.
 #define _noise_h_
 
 void seed(unsigned int x);
+// number of calls to seed, for invalidating cached noise
+unsigned int seed_count(void);
 
 float simplex2(
     float x, float y,
@@ -37,4 +39,12 @@ float simplex3(
     float x, float y, float z,
     int octaves, float persistence, float lacunarity);
 
+void simplex2_batch(
+    const float *x, const float *y, float *result, int count,
+    int octaves, float persistence, float lacunarity);
+
+void simplex3_batch(
+    const float *x, const float *y, const float *z, float *result, int count,
+    int octaves, float persistence, float lacunarity);
+
 #endif
@@ -12,7 +12,9 @@
 #endif
 
 #include "libretro.h"
+#include "../src/db.h"
 #include "../src/util.h"
+#include "../src/world.h"
 
 static struct retro_log_callback logging;
 
@@ -133,6 +135,16 @@ void retro_set_environment(retro_environment_t cb)
          "Right analog sensitivity; 0.0150|0.0175|0.0200|0.0225|0.0250|0.0275|0.0300|0.0325|0.0350|0.0375|0.0400|0.0425|0.0450|0.0475|0.0500" },
       { "craft_deadzone_radius",
          "Analog deadzone size; 0.010|0.015|0.020|0.025|0.030|0.035|0.040|0.045|0.050|0.055|0.060|0.065|0.070|0.075|0.080|0.085|0.090|0.095|0.100|0.110|0.115|0.120|0.125|0.130|0.135|0.140|0.145|0.150|0.155|0.160|0.165|0.170|0.175|0.180|0.185|0.190|0.195|0.200" },
+      { "craft_storage_backend",
+         "Storage backend (restart); sqlite|region" },
+      { "craft_db_durability",
+         "Database durability (restart); auto|full|normal|off|memory" },
+      { "craft_terrain",
+         "Terrain noise for new worlds (restart); exact|fast" },
+      { "craft_net_time_budget",
+         "Server data time budget per frame (ms); 4|1|2|8|16|unlimited" },
+      { "craft_net_message_budget",
+         "Server messages per frame; unlimited|16|64|256|1024|4096" },
       { NULL, NULL },
    };
 
@@ -260,6 +272,60 @@ static void check_variables(bool first_time_startup)
    {
       DEADZONE_RADIUS = atof(var.value);
    }
+
+   var.key = "craft_storage_backend";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+         first_time_startup)
+   {
+      if (!strcmp(var.value, "sqlite"))
+         DB_BACKEND = DB_BACKEND_SQLITE;
+      else if (!strcmp(var.value, "region"))
+         DB_BACKEND = DB_BACKEND_REGION;
+   }
+
+   var.key = "craft_db_durability";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+         first_time_startup)
+   {
+      if (!strcmp(var.value, "auto"))
+         DB_DURABILITY = DB_DURABILITY_AUTO;
+      else if (!strcmp(var.value, "full"))
+         DB_DURABILITY = DB_DURABILITY_FULL;
+      else if (!strcmp(var.value, "normal"))
+         DB_DURABILITY = DB_DURABILITY_NORMAL;
+      else if (!strcmp(var.value, "off"))
+         DB_DURABILITY = DB_DURABILITY_OFF;
+      else if (!strcmp(var.value, "memory"))
+         DB_DURABILITY = DB_DURABILITY_MEMORY;
+   }
+
+   var.key = "craft_terrain";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+         first_time_startup)
+   {
+      if (!strcmp(var.value, "exact"))
+         WORLD_TERRAIN = TERRAIN_EXACT;
+      else if (!strcmp(var.value, "fast"))
+         WORLD_TERRAIN = TERRAIN_FAST;
+   }
+
+   var.key = "craft_net_time_budget";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      // unlimited reads as zero
+      NET_TIME_BUDGET = atoi(var.value);
+   }
+
+   var.key = "craft_net_message_budget";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      NET_MESSAGE_BUDGET = atoi(var.value);
+   }
 }
 
 static unsigned logic_frames        = 0;
@@ -1,12 +1,15 @@
+from collections import OrderedDict
 from math import floor
 from world import World
 import Queue
 import SocketServer
 import datetime
+import itertools
 import random
 import re
 import requests
 import sqlite3
+import struct
 import sys
 import threading
 import time
@@ -21,6 +24,7 @@ LOG_PATH = 'log.txt'
 CHUNK_SIZE = 32
 BUFFER_SIZE = 4096
 COMMIT_INTERVAL = 5
+SCHEMA_VERSION = 1
 
 AUTH_REQUIRED = True
 AUTH_URL = 'https://craft.michaelfogleman.com/api/1/access'
@@ -38,12 +42,14 @@ ALLOWED_ITEMS = set([
 
 AUTHENTICATE = 'A'
 BLOCK = 'B'
+BLOCKS = 'M'
 CHUNK = 'C'
 DISCONNECT = 'D'
 KEY = 'K'
 LIGHT = 'L'
 NICK = 'N'
 POSITION = 'P'
+PING = 'Q'
 REDRAW = 'R'
 SIGN = 'S'
 TALK = 'T'
@@ -51,6 +57,18 @@ TIME = 'E'
 VERSION = 'V'
 YOU = 'U'
 
+# binary protocol, see src/client.h
+PROTOCOL_TEXT = 1
+PROTOCOL_BINARY = 2
+FRAME_TEXT = '#'
+FRAME_RUN = 4096
+VERSION_CACHE_SIZE = 65536
+SUBSCRIPTION_RADIUS = 32
+CHUNK_CACHE_BYTES = 64 * 1024 * 1024
+STATS_INTERVAL = 60
+READ_THREADS = 4
+LATENCY_SAMPLES = 100000
+
 try:
     from config import *
 except ImportError:
@@ -66,9 +84,43 @@ def log(*args):
 def chunked(x):
     return int(floor(round(x) / CHUNK_SIZE))
 
+def percentiles(samples):
+    samples = sorted(samples)
+    n = len(samples)
+    return '%d p50 %.1fms p90 %.1fms p99 %.1fms max %.1fms' % ((n,) + tuple(
+        1000 * samples[min(n - 1, n * x / 100)] for x in (50, 90, 99, 100)))
+
 def packet(*args):
     return '%s\n' % ','.join(map(str, args))
 
+def frame(command, payload):
+    return struct.pack('<cI', command, len(payload)) + payload
+
+def frame_run(command, p, q, rows):
+    frames = []
+    for i in xrange(0, len(rows), FRAME_RUN):
+        payload = [struct.pack('<ii', p, q)]
+        for x, y, z, w in rows[i:i + FRAME_RUN]:
+            payload.append(struct.pack('<hhhh',
+                x - p * CHUNK_SIZE, y, z - q * CHUNK_SIZE, w))
+        frames.append(frame(command, ''.join(payload)))
+    return ''.join(frames)
+
+def binary_packet(*args):
+    command, args = args[0], args[1:]
+    if command in (BLOCK, LIGHT):
+        p, q, x, y, z, w = map(int, args)
+        return frame_run(command, p, q, [(x, y, z, w)])
+    if command in (YOU, POSITION):
+        return frame(command, struct.pack('<i%df' % (len(args) - 1), *args))
+    if command == DISCONNECT:
+        return frame(command, struct.pack('<i', *args))
+    if command == KEY:
+        return frame(command, struct.pack('<%di' % len(args), *args))
+    if command == REDRAW:
+        return frame(command, struct.pack('<ii', *args))
+    return frame(FRAME_TEXT, packet(command, *args)[:-1])
+
 class RateLimiter(object):
     def __init__(self, rate, per):
         self.rate = float(rate)
@@ -90,6 +142,74 @@ class RateLimiter(object):
             self.allowance -= 1
             return False # okay
 
+class LineBuffer(object):
+    # splits what a connection receives into lines, in time linear in
+    # the number of bytes however they arrive
+    def __init__(self):
+        self.data = bytearray()
+    def feed(self, data):
+        self.data.extend(data)
+        find = self.data.find
+        lines = []
+        start = 0
+        index = find('\n')
+        while index >= 0:
+            end = index
+            if end > start and self.data[end - 1] == 13: # \r\n
+                end -= 1
+            lines.append(str(self.data[start:end]))
+            start = index + 1
+            index = find('\n', start)
+        del self.data[:start]
+        return lines
+
+class ChunkCache(object):
+    # serialized chunk responses, least recently used first. a response
+    # depends on the chunk, the protocol and the versions asked for, and
+    # all of them are dropped when the chunk changes
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.size = 0
+        self.entries = OrderedDict()
+        self.chunks = {}
+        self.hits = self.misses = self.evictions = self.invalidations = 0
+    def get(self, key):
+        data = self.entries.pop(key, None)
+        if data is None:
+            self.misses += 1
+            return None
+        self.hits += 1
+        self.entries[key] = data
+        return data
+    def put(self, key, data):
+        if key in self.entries:
+            # two reader threads can miss on the same chunk
+            self.remove(key)
+        if len(data) > self.capacity:
+            return
+        while self.size + len(data) > self.capacity:
+            self.remove(next(iter(self.entries)))
+            self.evictions += 1
+        self.entries[key] = data
+        self.size += len(data)
+        self.chunks.setdefault(key[:2], set()).add(key)
+    def remove(self, key):
+        self.size -= len(self.entries.pop(key))
+        keys = self.chunks[key[:2]]
+        keys.discard(key)
+        if not keys:
+            del self.chunks[key[:2]]
+    def invalidate(self, p, q):
+        for key in list(self.chunks.get((p, q), ())):
+            self.remove(key)
+            self.invalidations += 1
+    def stats(self):
+        lookups = self.hits + self.misses
+        return 'CACHE %d hits %d misses (%.1f%%) %d evictions %d ' \
+            'invalidations %d entries %d bytes' % (
+            self.hits, self.misses, 100.0 * self.hits / max(lookups, 1),
+            self.evictions, self.invalidations, len(self.entries), self.size)
+
 class Server(SocketServer.ThreadingMixIn, SocketServer.TCPServer):
     allow_reuse_address = True
     daemon_threads = True
@@ -109,16 +229,12 @@ class Handler(SocketServer.BaseRequestHandler):
         model = self.server.model
         model.enqueue(model.on_connect, self)
         try:
-            buf = []
+            buf = LineBuffer()
             while True:
                 data = self.request.recv(BUFFER_SIZE)
                 if not data:
                     break
-                buf.extend(data.replace('\r\n', '\n'))
-                while '\n' in buf:
-                    index = buf.index('\n')
-                    line = ''.join(buf[:index])
-                    buf = buf[index + 1:]
+                for line in buf.feed(data):
                     if not line:
                         continue
                     if line[0] == POSITION:
@@ -164,19 +280,41 @@ class Handler(SocketServer.BaseRequestHandler):
         if data:
             self.queue.put(data)
     def send(self, *args):
-        self.send_raw(packet(*args))
+        self.send_raw(self.encode(*args))
+    def encode(self, *args):
+        if self.version == PROTOCOL_BINARY:
+            return binary_packet(*args)
+        return packet(*args)
+    def encode_run(self, command, p, q, rows):
+        if self.version == PROTOCOL_BINARY:
+            return frame_run(command, p, q, rows)
+        return ''.join(packet(command, p, q, *row) for row in rows)
 
 class Model(object):
     def __init__(self, seed):
         self.world = World(seed)
         self.clients = []
-        self.queue = Queue.Queue()
+        self.subscribers = {}
+        self.occupants = {}
+        self.versions = {}
+        self.chunk_cache = ChunkCache(CHUNK_CACHE_BYTES)
+        self.dirty = set()
+        self.generation = 0
+        self.changed_at = {}
+        self.changed_floor = 0
+        self.queue = Queue.PriorityQueue()
+        self.sequence = itertools.count()
+        self.reads = Queue.Queue()
+        self.queue_latency = []
+        self.read_latency = []
         self.commands = {
             AUTHENTICATE: self.on_authenticate,
             CHUNK: self.on_chunk,
             BLOCK: self.on_block,
+            BLOCKS: self.on_blocks,
             LIGHT: self.on_light,
             POSITION: self.on_position,
+            PING: self.on_ping,
             TALK: self.on_talk,
             SIGN: self.on_sign,
             VERSION: self.on_version,
@@ -195,28 +333,76 @@ class Model(object):
         thread.start()
     def run(self):
         self.connection = sqlite3.connect(DB_PATH)
+        # readers see the last commit while the model thread writes
+        self.execute('pragma journal_mode = wal;')
         self.create_tables()
         self.commit()
+        for i in xrange(READ_THREADS):
+            thread = threading.Thread(target=self.read)
+            thread.setDaemon(True)
+            thread.start()
+        self.last_stats = time.time()
+        self.lookups = 0
         while True:
             try:
                 if time.time() - self.last_commit > COMMIT_INTERVAL:
                     self.commit()
+                if time.time() - self.last_stats > STATS_INTERVAL:
+                    self.log_stats()
                 self.dequeue()
             except Exception:
                 traceback.print_exc()
+    def read(self):
+        # serves chunk requests from a connection of its own, in
+        # parallel with the model thread and the other readers
+        connection = sqlite3.connect(DB_PATH)
+        connection.execute('pragma query_only = 1;')
+        while True:
+            client, args, generation, queued = self.reads.get()
+            if len(self.read_latency) < LATENCY_SAMPLES:
+                self.read_latency.append(time.time() - queued)
+            try:
+                p, q = args[:2]
+                versions = self.query_versions(connection.execute, p, q)
+                result = self.read_chunk(
+                    connection.execute, client, versions, *args)
+            except Exception:
+                traceback.print_exc()
+                result = None
+            # finished reads go ahead of the requests waiting behind them
+            self.queue.put((0, next(self.sequence), time.time(),
+                self.on_chunk_read, (client, args, generation, result), {}))
     def enqueue(self, func, *args, **kwargs):
-        self.queue.put((func, args, kwargs))
+        self.queue.put((1, next(self.sequence), time.time(),
+            func, args, kwargs))
     def dequeue(self):
         try:
-            func, args, kwargs = self.queue.get(timeout=5)
+            priority, sequence, queued, func, args, kwargs = \
+                self.queue.get(timeout=5)
+            if len(self.queue_latency) < LATENCY_SAMPLES:
+                self.queue_latency.append(time.time() - queued)
             func(*args, **kwargs)
         except Queue.Empty:
             pass
+    def log_stats(self):
+        self.last_stats = time.time()
+        cache = self.chunk_cache
+        if cache.hits + cache.misses != self.lookups:
+            self.lookups = cache.hits + cache.misses
+            log(cache.stats())
+        for name in ('queue', 'read'):
+            samples = getattr(self, name + '_latency')
+            setattr(self, name + '_latency', [])
+            if samples:
+                log('QUEUE', name, percentiles(samples))
     def execute(self, *args, **kwargs):
         return self.connection.execute(*args, **kwargs)
+    def executemany(self, *args, **kwargs):
+        return self.connection.executemany(*args, **kwargs)
     def commit(self):
         self.last_commit = time.time()
         self.connection.commit()
+        self.dirty.clear()
     def create_tables(self):
         queries = [
             'create table if not exists block ('
@@ -262,6 +448,21 @@ class Model(object):
         ]
         for query in queries:
             self.execute(query)
+        self.migrate()
+    def migrate(self):
+        version = self.execute('pragma user_version;').fetchone()[0]
+        if version < SCHEMA_VERSION:
+            # blocks are stored once, in their own chunk; clients derive
+            # the neighbor padding at mesh time
+            query = (
+                'delete from block where w < 0 '
+                'or p != (case when x >= 0 then x / :n '
+                'else (x + 1) / :n - 1 end) '
+                'or q != (case when z >= 0 then z / :n '
+                'else (z + 1) / :n - 1 end);'
+            )
+            self.execute(query, dict(n=CHUNK_SIZE))
+            self.execute('pragma user_version = %d;' % SCHEMA_VERSION)
     def get_default_block(self, x, y, z):
         p, q = chunked(x), chunked(z)
         chunk = self.world.get_chunk(p, q)
@@ -276,6 +477,53 @@ class Model(object):
         if rows:
             return rows[0][0]
         return self.get_default_block(x, y, z)
+    def get_versions(self, p, q):
+        # the highest block, light and sign rowid of a chunk. changes
+        # always insert a new row, so these only grow
+        versions = self.versions.get((p, q))
+        if versions is None:
+            versions = self.query_versions(self.execute, p, q)
+            self.cache_versions(p, q, versions)
+        return versions
+    def query_versions(self, execute, p, q):
+        return tuple(execute(
+            'select max(rowid) from %s where p = :p and q = :q;' % table,
+            dict(p=p, q=q)).fetchone()[0] or 0
+            for table in ('block', 'light', 'sign'))
+    def cache_versions(self, p, q, versions):
+        if len(self.versions) >= VERSION_CACHE_SIZE:
+            self.versions.clear()
+        self.versions[(p, q)] = versions
+    def changed(self, p, q):
+        # dirty chunks have writes the readers cannot see yet, and the
+        # generation tells whether a chunk changed while being read
+        self.versions.pop((p, q), None)
+        self.chunk_cache.invalidate(p, q)
+        self.dirty.add((p, q))
+        self.generation += 1
+        if len(self.changed_at) >= VERSION_CACHE_SIZE:
+            self.changed_at.clear()
+            self.changed_floor = self.generation
+        self.changed_at[(p, q)] = self.generation
+    def changed_since(self, p, q, generation):
+        return max(self.changed_at.get((p, q), 0),
+            self.changed_floor) > generation
+    def clear_lights(self, rows):
+        # lights and signs under removed blocks are overwritten rather
+        # than deleted, so the new rowid reaches clients with a cache
+        query = (
+            'insert or replace into light (p, q, x, y, z, w) '
+            'select p, q, x, y, z, 0 from light where '
+            'x = ? and y = ? and z = ? and w != 0;'
+        )
+        self.executemany(query, rows)
+    def clear_signs(self, rows):
+        query = (
+            'insert or replace into sign (p, q, x, y, z, face, text) '
+            'select p, q, x, y, z, face, \'\' from sign where '
+            'x = ? and y = ? and z = ? and text != \'\';'
+        )
+        self.executemany(query, rows)
     def next_client_id(self):
         result = 1
         client_ids = set(x.client_id for x in self.clients)
@@ -287,15 +535,17 @@ class Model(object):
         client.nick = 'guest%d' % client.client_id
         log('CONN', client.client_id, *client.client_address)
         client.position = SPAWN_POINT
+        client.velocity = (0, 0, 0)
+        client.chunk = None
+        client.chunks = set()
+        client.viewers = set()
         self.clients.append(client)
         client.send(YOU, client.client_id, *client.position)
         client.send(TIME, time.time(), DAY_LENGTH)
         client.send(TALK, 'Welcome to Craft!')
         client.send(TALK, 'Type "/help" for a list of commands.')
-        self.send_position(client)
-        self.send_positions(client)
         self.send_nick(client)
-        self.send_nicks(client)
+        self.send_position(client)
     def on_data(self, client, data):
         #log('RECV', client.client_id, data)
         args = data.split(',')
@@ -307,12 +557,22 @@ class Model(object):
         log('DISC', client.client_id, *client.client_address)
         self.clients.remove(client)
         self.send_disconnect(client)
+        for chunk in client.chunks:
+            self.subscribers[chunk].discard(client)
+        if client.chunk is not None:
+            self.occupants[client.chunk].discard(client)
+        for other in self.clients:
+            other.viewers.discard(client)
         self.send_talk('%s has disconnected from the server.' % client.nick)
     def on_version(self, client, version):
+        version = int(version)
         if client.version is not None:
+            if client.version == PROTOCOL_TEXT and version == PROTOCOL_BINARY:
+                # the last text line, frames follow
+                client.send(VERSION, version)
+                client.version = version
             return
-        version = int(version)
-        if version != 1:
+        if version != PROTOCOL_TEXT:
             client.stop()
             return
         client.version = version
@@ -336,44 +596,104 @@ class Model(object):
         self.send_nick(client)
         # TODO: has left message if was already authenticated
         self.send_talk('%s has joined the game.' % client.nick)
-    def on_chunk(self, client, p, q, key=0):
-        packets = []
+    def on_chunk(self, client, p, q, key=0, light_key=None, sign_key=None):
+        # clients that send light and sign versions only get what
+        # changed since, or just the C line if nothing did. answers are
+        # cached until the chunk changes, and read by the reader threads
+        # unless the chunk has uncommitted writes
         p, q, key = map(int, (p, q, key))
+        self.subscribe(client, p, q)
+        versioned = light_key is not None and sign_key is not None
+        if versioned:
+            light_key, sign_key = int(light_key), int(sign_key)
+        else:
+            light_key = sign_key = 0
+        args = (p, q, key, light_key, sign_key, versioned)
+        versions = self.versions.get((p, q))
+        if versioned and versions and self.up_to_date(versions, *args):
+            client.send(CHUNK, p, q)
+            return
+        data = self.chunk_cache.get((p, q, client.version) + args[2:])
+        if data is not None:
+            client.send_raw(data)
+        elif READ_THREADS and (p, q) not in self.dirty:
+            self.reads.put((client, args, self.generation, time.time()))
+        else:
+            self.send_chunk(client, args, self.read_chunk(
+                self.execute, client, self.get_versions(p, q), *args))
+    def on_chunk_read(self, client, args, generation, result):
+        # back on the model thread, so the answer is ordered with the
+        # changes sent since; a chunk that changed meanwhile is read again
+        p, q = args[:2]
+        if client not in self.clients:
+            return
+        if result is None or self.changed_since(p, q, generation):
+            result = self.read_chunk(
+                self.execute, client, self.get_versions(p, q), *args)
+        elif (p, q) not in self.versions:
+            self.cache_versions(p, q, result[0])
+        self.send_chunk(client, args, result)
+    def send_chunk(self, client, args, result):
+        versions, data, cacheable = result
+        if cacheable:
+            self.chunk_cache.put(
+                (args[0], args[1], client.version) + args[2:], data)
+        client.send_raw(data)
+    def up_to_date(self, versions, p, q, key, light_key, sign_key, versioned):
+        return versioned and (versions[0] <= key and
+            versions[1] <= light_key and versions[2] <= sign_key)
+    def read_chunk(self, execute, client, versions, p, q, key, light_key,
+            sign_key, versioned):
+        # returns the versions, the answer and whether it can be cached
+        if self.up_to_date(versions, p, q, key, light_key, sign_key,
+                versioned):
+            return versions, client.encode(CHUNK, p, q), False
+        return versions, self.serialize_chunk(execute, client, versions,
+            p, q, key, light_key, sign_key, versioned), True
+    def serialize_chunk(self, execute, client, versions, p, q, key, light_key,
+            sign_key, versioned):
+        packets = []
         query = (
             'select rowid, x, y, z, w from block where '
             'p = :p and q = :q and rowid > :key;'
         )
-        rows = self.execute(query, dict(p=p, q=q, key=key))
+        rows = execute(query, dict(p=p, q=q, key=key))
         max_rowid = 0
-        blocks = 0
+        blocks = []
         for rowid, x, y, z, w in rows:
-            blocks += 1
-            packets.append(packet(BLOCK, p, q, x, y, z, w))
+            blocks.append((x, y, z, w))
             max_rowid = max(max_rowid, rowid)
+        packets.append(client.encode_run(BLOCK, p, q, blocks))
         query = (
             'select x, y, z, w from light where '
-            'p = :p and q = :q;'
-        )
-        rows = self.execute(query, dict(p=p, q=q))
-        lights = 0
-        for x, y, z, w in rows:
-            lights += 1
-            packets.append(packet(LIGHT, p, q, x, y, z, w))
-        query = (
-            'select x, y, z, face, text from sign where '
-            'p = :p and q = :q;'
+            'p = :p and q = :q and rowid > :key;'
         )
-        rows = self.execute(query, dict(p=p, q=q))
+        lights = list(execute(query, dict(p=p, q=q, key=light_key)))
+        packets.append(client.encode_run(LIGHT, p, q, lights))
+        if versioned:
+            # emptied signs are how removals reach a cached copy
+            query = (
+                'select x, y, z, face, text from sign where '
+                'p = :p and q = :q and rowid > :key;'
+            )
+        else:
+            query = (
+                'select x, y, z, face, text from sign where '
+                'p = :p and q = :q and text != \'\';'
+            )
+        rows = execute(query, dict(p=p, q=q, key=sign_key))
         signs = 0
         for x, y, z, face, text in rows:
             signs += 1
-            packets.append(packet(SIGN, p, q, x, y, z, face, text))
-        if blocks:
-            packets.append(packet(KEY, p, q, max_rowid))
+            packets.append(client.encode(SIGN, p, q, x, y, z, face, text))
+        if versioned and (blocks or lights or signs):
+            packets.append(client.encode(KEY, p, q, *versions))
+        elif blocks:
+            packets.append(client.encode(KEY, p, q, max_rowid))
         if blocks or lights or signs:
-            packets.append(packet(REDRAW, p, q))
-        packets.append(packet(CHUNK, p, q))
-        client.send_raw(''.join(packets))
+            packets.append(client.encode(REDRAW, p, q))
+        packets.append(client.encode(CHUNK, p, q))
+        return ''.join(packets)
     def on_block(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
         p, q = chunked(x), chunked(z)
@@ -409,28 +729,74 @@ class Model(object):
         )
         self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
         self.send_block(client, p, q, x, y, z, w)
-        for dx in range(-1, 2):
-            for dz in range(-1, 2):
-                if dx == 0 and dz == 0:
-                    continue
-                if dx and chunked(x + dx) == p:
-                    continue
-                if dz and chunked(z + dz) == q:
-                    continue
-                np, nq = p + dx, q + dz
-                self.execute(query, dict(p=np, q=nq, x=x, y=y, z=z, w=-w))
-                self.send_block(client, np, nq, x, y, z, -w)
         if w == 0:
-            query = (
-                'delete from sign where '
-                'x = :x and y = :y and z = :z;'
-            )
-            self.execute(query, dict(x=x, y=y, z=z))
-            query = (
-                'update light set w = 0 where '
-                'x = :x and y = :y and z = :z;'
-            )
-            self.execute(query, dict(x=x, y=y, z=z))
+            self.clear_signs([(x, y, z)])
+            self.clear_lights([(x, y, z)])
+        self.changed(p, q)
+    def on_blocks(self, client, p, q, *args):
+        # x, y, z, w for each block of chunk (p, q), checked in order
+        # against the same rules as on_block
+        p, q = int(p), int(q)
+        args = map(int, args)
+        rows = [tuple(args[i:i + 4]) for i in xrange(0, len(args) - 3, 4)]
+        query = (
+            'select x, y, z, w from block where '
+            'p = :p and q = :q;'
+        )
+        current = dict(self.world.get_chunk(p, q))
+        for x, y, z, w in self.execute(query, dict(p=p, q=q)):
+            current[(x, y, z)] = w
+        accepted = []
+        rejected = set()
+        message = None
+        for x, y, z, w in rows:
+            previous = current.get((x, y, z), 0)
+            if AUTH_REQUIRED and client.user_id is None:
+                message = 'Only logged in users are allowed to build.'
+            elif chunked(x) != p or chunked(z) != q:
+                continue
+            elif y <= 0:
+                message = 'Invalid block coordinates.'
+            elif w not in ALLOWED_ITEMS:
+                message = 'That item is not allowed.'
+            elif w and previous:
+                message = 'Cannot create blocks in a non-empty space.'
+            elif not w and not previous:
+                message = 'That space is already empty.'
+            elif previous in INDESTRUCTIBLE_ITEMS:
+                message = 'Cannot destroy that type of block.'
+            else:
+                current[(x, y, z)] = w
+                accepted.append((x, y, z, w))
+                continue
+            rejected.add((x, y, z))
+        if rejected:
+            client.send_raw(client.encode_run(BLOCK, p, q,
+                [key + (current.get(key, 0),) for key in rejected]) +
+                client.encode(REDRAW, p, q))
+            client.send(TALK, message)
+        if not accepted:
+            return
+        if RECORD_HISTORY:
+            now = time.time()
+            self.executemany(
+                'insert into block_history (timestamp, user_id, x, y, z, w) '
+                'values (?, ?, ?, ?, ?, ?);',
+                [(now, client.user_id) + row for row in accepted])
+        self.executemany(
+            'insert or replace into block (p, q, x, y, z, w) '
+            'values (?, ?, ?, ?, ?, ?);',
+            [(p, q) + row for row in accepted])
+        removed = [(x, y, z) for x, y, z, w in accepted if w == 0]
+        if removed:
+            self.clear_signs(removed)
+            self.clear_lights(removed)
+        self.changed(p, q)
+        for other in self.subscribers.get((p, q), ()):
+            if other == client:
+                continue
+            other.send_raw(other.encode_run(BLOCK, p, q, accepted) +
+                other.encode(REDRAW, p, q))
     def on_light(self, client, x, y, z, w):
         x, y, z, w = map(int, (x, y, z, w))
         p, q = chunked(x), chunked(z)
@@ -452,6 +818,7 @@ class Model(object):
             'values (:p, :q, :x, :y, :z, :w);'
         )
         self.execute(query, dict(p=p, q=q, x=x, y=y, z=z, w=w))
+        self.changed(p, q)
         self.send_light(client, p, q, x, y, z, w)
     def on_sign(self, client, x, y, z, face, *args):
         if AUTH_REQUIRED and client.user_id is None:
@@ -475,15 +842,23 @@ class Model(object):
                 dict(p=p, q=q, x=x, y=y, z=z, face=face, text=text))
         else:
             query = (
-                'delete from sign where '
-                'x = :x and y = :y and z = :z and face = :face;'
+                'insert or replace into sign (p, q, x, y, z, face, text) '
+                'select p, q, x, y, z, face, \'\' from sign where '
+                'x = :x and y = :y and z = :z and face = :face '
+                'and text != \'\';'
             )
             self.execute(query, dict(x=x, y=y, z=z, face=face))
+        self.changed(p, q)
         self.send_sign(client, p, q, x, y, z, face, text)
-    def on_position(self, client, x, y, z, rx, ry):
+    def on_position(self, client, x, y, z, rx, ry, vx=0, vy=0, vz=0):
+        # binary protocol clients add their velocity and only send
+        # when the extrapolated position drifts
         x, y, z, rx, ry = map(float, (x, y, z, rx, ry))
         client.position = (x, y, z, rx, ry)
+        client.velocity = tuple(map(float, (vx, vy, vz)))
         self.send_position(client)
+    def on_ping(self, client, *args):
+        client.send(PING, *args)
     def on_talk(self, client, *args):
         text = ','.join(args)
         if text.startswith('/'):
@@ -517,6 +892,7 @@ class Model(object):
             self.send_nick(client)
     def on_spawn(self, client):
         client.position = SPAWN_POINT
+        client.velocity = (0, 0, 0)
         client.send(YOU, client.client_id, *client.position)
         self.send_position(client)
     def on_goto(self, client, nick=None):
@@ -528,6 +904,7 @@ class Model(object):
             other = nicks.get(nick)
         if other:
             client.position = other.position
+            client.velocity = (0, 0, 0)
             client.send(YOU, client.client_id, *client.position)
             self.send_position(client)
     def on_pq(self, client, p, q):
@@ -535,6 +912,7 @@ class Model(object):
         if abs(p) > 1000 or abs(q) > 1000:
             return
         client.position = (p * CHUNK_SIZE, 0, q * CHUNK_SIZE, 0, 0)
+        client.velocity = (0, 0, 0)
         client.send(YOU, client.client_id, *client.position)
         self.send_position(client)
     def on_help(self, client, topic=None):
@@ -581,43 +959,79 @@ class Model(object):
     def on_list(self, client):
         client.send(TALK,
             'Players: %s' % ', '.join(x.nick for x in self.clients))
-    def send_positions(self, client):
-        for other in self.clients:
-            if other == client:
-                continue
-            client.send(POSITION, other.client_id, *other.position)
+    def subscribe(self, client, p, q):
+        # clients are sent the changes to the chunks they asked for and
+        # the players standing in them, instead of everything
+        if (p, q) in client.chunks:
+            return
+        client.chunks.add((p, q))
+        self.subscribers.setdefault((p, q), set()).add(client)
+        for other in self.occupants.get((p, q), ()):
+            if other != client and client not in other.viewers:
+                self.show(client, other)
+    def unsubscribe_far(self, client):
+        # clients never say when they drop a chunk, but they have by the
+        # time it is this far away; asking again subscribes again
+        p, q = client.chunk
+        far = [(a, b) for a, b in client.chunks
+            if max(abs(a - p), abs(b - q)) > SUBSCRIPTION_RADIUS]
+        for chunk in far:
+            client.chunks.discard(chunk)
+            self.subscribers[chunk].discard(client)
+    def show(self, client, other):
+        # client starts seeing other
+        other.viewers.add(client)
+        client.send(POSITION, other.client_id, *self.motion(client, other))
+        client.send(NICK, other.client_id, other.nick)
+    def hide(self, client, other):
+        other.viewers.discard(client)
+        client.send(DISCONNECT, other.client_id)
     def send_position(self, client):
-        for other in self.clients:
-            if other == client:
-                continue
-            other.send(POSITION, client.client_id, *client.position)
-    def send_nicks(self, client):
-        for other in self.clients:
+        x, y, z, rx, ry = client.position
+        chunk = (chunked(x), chunked(z))
+        if chunk != client.chunk:
+            if client.chunk is not None:
+                self.occupants[client.chunk].discard(client)
+            self.occupants.setdefault(chunk, set()).add(client)
+            client.chunk = chunk
+            self.unsubscribe_far(client)
+        watchers = self.subscribers.get(chunk, ())
+        for other in [o for o in client.viewers if o not in watchers]:
+            self.hide(other, client)
+        for other in watchers:
             if other == client:
                 continue
-            client.send(NICK, other.client_id, other.nick)
+            if other in client.viewers:
+                other.send(POSITION, client.client_id,
+                    *self.motion(other, client))
+            else:
+                self.show(other, client)
+    def motion(self, client, other):
+        # what client is told about where other is going
+        if client.version == PROTOCOL_BINARY:
+            return other.position + other.velocity
+        return other.position
     def send_nick(self, client):
-        for other in self.clients:
+        client.send(NICK, client.client_id, client.nick)
+        for other in client.viewers:
             other.send(NICK, client.client_id, client.nick)
     def send_disconnect(self, client):
-        for other in self.clients:
-            if other == client:
-                continue
+        for other in client.viewers:
             other.send(DISCONNECT, client.client_id)
     def send_block(self, client, p, q, x, y, z, w):
-        for other in self.clients:
+        for other in self.subscribers.get((p, q), ()):
             if other == client:
                 continue
             other.send(BLOCK, p, q, x, y, z, w)
             other.send(REDRAW, p, q)
     def send_light(self, client, p, q, x, y, z, w):
-        for other in self.clients:
+        for other in self.subscribers.get((p, q), ()):
             if other == client:
                 continue
             other.send(LIGHT, p, q, x, y, z, w)
             other.send(REDRAW, p, q)
     def send_sign(self, client, p, q, x, y, z, face, text):
-        for other in self.clients:
+        for other in self.subscribers.get((p, q), ()):
             if other == client:
                 continue
             other.send(SIGN, p, q, x, y, z, face, text)
@@ -12,26 +12,103 @@
 #endif
 #endif
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "client.h"
+#include "perf.h"
+#include "util.h"
 #include "tinycthread.h"
 
 #include <retro_timers.h>
 
-#define QUEUE_SIZE 1048576
-#define RECV_SIZE 4096
+#ifndef SHUT_RDWR
+#define SHUT_RDWR 2 /* SD_BOTH */
+#endif
+
+/* The receive queue is a single producer, single consumer byte ring.
+   recv_worker receives straight into it and publishes ring_head, the
+   main thread reads messages in place and publishes ring_tail. Both
+   indices only grow, their difference is the fill level. */
+#define RING_SIZE 1048576
+#define RING_MASK (RING_SIZE - 1)
+
+#if defined(__GNUC__)
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+/* MSVC gives volatile accesses acquire and release semantics */
+#define RING_LOAD(p) (*(volatile unsigned int *)(p))
+#define RING_STORE(p, v) (*(volatile unsigned int *)(p) = (v))
+#endif
 
 static int client_enabled = 0;
 static int running = 0;
 static int sd = 0;
 static int bytes_sent = 0;
 static int bytes_received = 0;
-static char *queue = 0;
-static int qsize = 0;
+static char *ring = 0;
+static unsigned int ring_head = 0;
+static unsigned int ring_tail = 0;
+static unsigned int ring_next = 0;
+/* complete messages received and handed out, for client_pending. only
+   recv_worker writes ring_messages and scans with the recv_ fields */
+static unsigned int ring_messages = 0;
+static unsigned int messages_read = 0;
+static unsigned int recv_scan = 0;
+static int recv_binary = 0;
+static unsigned int max_fill = 0;
+static unsigned int stalls = 0;
+static double stall_time = 0;
+static char *scratch = 0;
+static unsigned int scratch_size = 0;
+static int protocol = PROTOCOL_TEXT;
 static thrd_t recv_thread;
-static mtx_t mutex;
+
+/* Outgoing messages are appended to send_buffer by the main thread and
+   written by send_worker, which swaps it with send_spare under send_mtx
+   so the socket is written without holding the lock. The buffer is
+   handed over by client_flush once per frame, or as soon as it holds
+   SEND_BATCH bytes; past SEND_LIMIT the main thread waits for the
+   worker to catch up. */
+#define SEND_BATCH 65536
+#define SEND_LIMIT 4194304
+/* how long client_stop lets the final write take */
+#define SEND_DEADLINE 1.0
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static char *send_buffer = 0;
+static char *send_spare = 0;
+static int send_length = 0;
+static int send_capacity = 0;
+static int spare_capacity = 0;
+static int send_ready = 0;
+static int send_running = 0;
+static int send_done = 0;
+static unsigned int send_calls = 0;
+static unsigned int send_batches = 0;
+static unsigned int send_messages = 0;
+static unsigned int positions_sent = 0;
+static unsigned int pings = 0;
+static double rtt = 0;
+static double average_rtt = 0;
+static double max_rtt = 0;
+static ClientCounter counters_in[CLIENT_TYPES];
+static ClientCounter counters_out[CLIENT_TYPES];
+
+static void count_message(ClientCounter *counters, char type, int bytes)
+{
+   ClientCounter *counter = counters + ((unsigned char)type & (CLIENT_TYPES - 1));
+   counter->count++;
+   counter->bytes += bytes;
+}
+static mtx_t send_mtx;
+static cnd_t send_cnd;
+static thrd_t send_thread;
 
 void client_enable(void)
 {
@@ -56,7 +133,9 @@ int client_sendall(int sd, char *data, int length)
 
    while (count < length)
    {
-      int n = send(sd, data + count, length, 0);
+      // a socket shut down under a blocked send must not raise SIGPIPE
+      int n = send(sd, data + count, length, MSG_NOSIGNAL);
+      send_calls++;
       if (n == -1)
          return -1;
       count += n;
@@ -66,26 +145,146 @@ int client_sendall(int sd, char *data, int length)
    return 0;
 }
 
+void client_flush(void)
+{
+   if (!client_enabled || !send_running)
+      return;
+   mtx_lock(&send_mtx);
+   if (send_length)
+   {
+      send_ready = 1;
+      cnd_broadcast(&send_cnd);
+   }
+   mtx_unlock(&send_mtx);
+}
+
 void client_send(char *data)
 {
+   int length;
+   if (!client_enabled)
+      return;
+   length = strlen(data);
+   count_message(counters_out, data[0], length);
+   if (!send_running)
+   {
+      if (client_sendall(sd, data, length) == -1)
+      {
+         perror("client_sendall");
+         exit(1);
+      }
+      return;
+   }
+   mtx_lock(&send_mtx);
+   while (send_length >= SEND_LIMIT && send_running)
+      cnd_wait(&send_cnd, &send_mtx);
+   if (send_length + length > send_capacity)
+   {
+      send_capacity = MAX(send_capacity * 2, send_length + length);
+      send_buffer = realloc(send_buffer, send_capacity);
+   }
+   memcpy(send_buffer + send_length, data, length);
+   send_length += length;
+   send_messages++;
+   if (send_length >= SEND_BATCH)
+   {
+      send_ready = 1;
+      cnd_broadcast(&send_cnd);
+   }
+   mtx_unlock(&send_mtx);
+}
+
+int send_worker(void *arg)
+{
+   mtx_lock(&send_mtx);
+   while (1)
+   {
+      char *data;
+      int length, capacity;
+      while (send_running && !(send_ready && send_length))
+         cnd_wait(&send_cnd, &send_mtx);
+      if (!send_length)
+         break;
+      // take the filled buffer and leave the spare one to append to
+      data = send_buffer;
+      length = send_length;
+      capacity = send_capacity;
+      send_buffer = send_spare;
+      send_capacity = spare_capacity;
+      send_length = 0;
+      send_ready = 0;
+      cnd_broadcast(&send_cnd);
+      mtx_unlock(&send_mtx);
+      if (client_sendall(sd, data, length) == -1)
+      {
+         if (send_running)
+         {
+            perror("client_sendall");
+            exit(1);
+         }
+         // stopping, drop whatever else was queued
+         mtx_lock(&send_mtx);
+         send_spare = data;
+         spare_capacity = capacity;
+         send_length = 0;
+         break;
+      }
+      mtx_lock(&send_mtx);
+      send_spare = data;
+      spare_capacity = capacity;
+      send_batches++;
+   }
+   send_done = 1;
+   cnd_broadcast(&send_cnd);
+   mtx_unlock(&send_mtx);
+   return 0;
+}
+
+void client_version(int version)
+{
+    char buffer[1024];
     if (!client_enabled)
         return;
-    if (client_sendall(sd, data, strlen(data)) == -1)
-    {
-        perror("client_sendall");
-        exit(1);
+    // servers only honor the first version they support, so older ones
+    // ignore the second message and keep talking text
+    client_send("V,1\n");
+    if (version > PROTOCOL_TEXT) {
+        snprintf(buffer, 1024, "V,%d\n", version);
+        client_send(buffer);
     }
 }
 
-void client_version(int version)
+void client_ping(void)
 {
-    char buffer[1024];
+    char buffer[64];
     if (!client_enabled)
         return;
-    snprintf(buffer, 1024, "V,%d\n", version);
+    snprintf(buffer, sizeof(buffer), "%c,%.6f\n", PING, perf_now());
     client_send(buffer);
 }
 
+// the echo of one of our pings, which is consumed here
+static int client_pong(const char *line, int length)
+{
+    char stamp[32];
+    double elapsed;
+    if (length < 2 || line[0] != PING || line[1] != ',')
+        return 0;
+    // frames are not NUL terminated
+    length = MIN(length - 2, (int)sizeof(stamp) - 1);
+    memcpy(stamp, line + 2, length);
+    stamp[length] = '\0';
+    elapsed = perf_now() - atof(stamp);
+    if (elapsed >= 0)
+    {
+        rtt = elapsed;
+        average_rtt = pings ? average_rtt * 0.875 + elapsed * 0.125 : elapsed;
+        if (elapsed > max_rtt)
+            max_rtt = elapsed;
+        pings++;
+    }
+    return 1;
+}
+
 void client_login(const char *username, const char *identity_token)
 {
     char buffer[1024];
@@ -95,6 +294,67 @@ void client_login(const char *username, const char *identity_token)
     client_send(buffer);
 }
 
+/* Dead reckoning: with the binary protocol a position is sent with the
+   velocity measured since the previous call, and only when the place
+   the others extrapolate to from the last one sent is off by more than
+   POSITION_ERROR, the velocity changed by VELOCITY_ERROR or the view
+   turned by ROTATION_ERROR. A jump of more than MAX_SPEED is a
+   teleport and is sent as standing still. */
+#define POSITION_ERROR 0.25f
+#define VELOCITY_ERROR 0.5f
+#define ROTATION_ERROR 0.02f
+#define MAX_SPEED 50.0f
+
+// the server decides who sees us from the chunk we were last in
+static int chunked(float x)
+{
+    return floorf(roundf(x) / CHUNK_SIZE);
+}
+
+static float sqr(float x)
+{
+    return x * x;
+}
+
+static void client_position_reckoned(
+    float x, float y, float z, float rx, float ry)
+{
+    static float lx, ly, lz;
+    static float sx, sy, sz, srx, sry, svx, svy, svz;
+    static double last = 0, sent = 0;
+    char buffer[1024];
+    double now = perf_now();
+    float vx = 0, vy = 0, vz = 0;
+    float dt = last ? now - last : 0;
+    // what receivers show, they stop extrapolating after a while
+    float t = MIN(now - sent, MAX_EXTRAPOLATION);
+    if (dt > 0)
+    {
+        vx = (x - lx) / dt;
+        vy = (y - ly) / dt;
+        vz = (z - lz) / dt;
+        if (sqr(vx) + sqr(vy) + sqr(vz) > sqr(MAX_SPEED))
+            vx = vy = vz = 0;
+    }
+    last = now;
+    lx = x; ly = y; lz = z;
+    if (sent &&
+        (t < MAX_EXTRAPOLATION || (!svx && !svy && !svz)) &&
+        sqr(sx + svx * t - x) + sqr(sy + svy * t - y) +
+        sqr(sz + svz * t - z) < sqr(POSITION_ERROR) &&
+        sqr(svx - vx) + sqr(svy - vy) + sqr(svz - vz) < sqr(VELOCITY_ERROR) &&
+        sqr(srx - rx) + sqr(sry - ry) < sqr(ROTATION_ERROR) &&
+        chunked(sx) == chunked(x) && chunked(sz) == chunked(z))
+        return;
+    sent = now;
+    sx = x; sy = y; sz = z; srx = rx; sry = ry;
+    svx = vx; svy = vy; svz = vz;
+    positions_sent++;
+    snprintf(buffer, 1024, "P,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+        x, y, z, rx, ry, vx, vy, vz);
+    client_send(buffer);
+}
+
 void client_position(float x, float y, float z, float rx, float ry)
 {
     static float px, py, pz, prx, pry = 0;
@@ -107,19 +367,29 @@ void client_position(float x, float y, float z, float rx, float ry)
         (pry - ry) * (pry - ry);
     if (!client_enabled)
         return;
+    if (protocol == PROTOCOL_BINARY)
+    {
+        client_position_reckoned(x, y, z, rx, ry);
+        return;
+    }
     if (distance < 0.0001)
         return;
     px = x; py = y; pz = z; prx = rx; pry = ry;
+    positions_sent++;
     snprintf(buffer, 1024, "P,%.2f,%.2f,%.2f,%.2f,%.2f\n", x, y, z, rx, ry);
     client_send(buffer);
 }
 
-void client_chunk(int p, int q, int key)
+void client_chunk(int p, int q, int key, int lights, int signs)
 {
     char buffer[1024];
     if (!client_enabled)
         return;
-    snprintf(buffer, 1024, "C,%d,%d,%d\n", p, q, key);
+    if (protocol == PROTOCOL_BINARY)
+        snprintf(buffer, 1024, "C,%d,%d,%d,%d,%d\n",
+            p, q, key, lights, signs);
+    else
+        snprintf(buffer, 1024, "C,%d,%d,%d\n", p, q, key);
     client_send(buffer);
 }
 
@@ -132,6 +402,32 @@ void client_block(int x, int y, int z, int w)
     client_send(buffer);
 }
 
+/* blocks holds x, y, z, w for each of count blocks of chunk (p, q).
+   Text only servers get one B line per block. */
+void client_blocks(int p, int q, const int *blocks, int count)
+{
+    char *buffer;
+    int i, length;
+    if (!client_enabled || count <= 0)
+        return;
+    if (protocol != PROTOCOL_BINARY)
+    {
+        for (i = 0; i < count; i++, blocks += 4)
+            client_block(blocks[0], blocks[1], blocks[2], blocks[3]);
+        return;
+    }
+    // 12 bytes holds a comma and any int
+    buffer = malloc(32 + count * 4 * 12);
+    length = sprintf(buffer, "%c,%d,%d", BLOCKS, p, q);
+    for (i = 0; i < count; i++, blocks += 4)
+        length += sprintf(buffer + length, ",%d,%d,%d,%d",
+            blocks[0], blocks[1], blocks[2], blocks[3]);
+    buffer[length++] = '\n';
+    buffer[length] = '\0';
+    client_send(buffer);
+    free(buffer);
+}
+
 void client_light(int x, int y, int z, int w)
 {
     char buffer[1024];
@@ -161,41 +457,221 @@ void client_talk(const char *text)
     client_send(buffer);
 }
 
-char *client_recv()
+int client_read_int(const char *data)
 {
-   char *result = 0;
-   char *p      = NULL;
-   if (!client_enabled)
-      return 0;
-   mtx_lock(&mutex);
-   p = queue + qsize - 1;
+   const unsigned char *u = (const unsigned char *)data;
+   return (int)((unsigned int)u[0] | (unsigned int)u[1] << 8 |
+         (unsigned int)u[2] << 16 | (unsigned int)u[3] << 24);
+}
+
+int client_read_short(const char *data)
+{
+   const unsigned char *u = (const unsigned char *)data;
+   return (short)(u[0] | u[1] << 8);
+}
 
-   while (p >= queue && *p != '\n')
-      p--;
+float client_read_float(const char *data)
+{
+   unsigned int bits = (unsigned int)client_read_int(data);
+   float result;
+   memcpy(&result, &bits, sizeof(result));
+   return result;
+}
 
-   if (p >= queue)
+/* Offset of the first c in the length bytes at start, or -1. */
+static int ring_find(unsigned int start, unsigned int length, char c)
+{
+   unsigned int offset = start & RING_MASK;
+   unsigned int first = RING_SIZE - offset;
+   char *p;
+   if (first >= length)
    {
-      int remaining;
-      int length = p - queue + 1;
-      result = malloc(sizeof(char) * (length + 1));
-      memcpy(result, queue, sizeof(char) * length);
-      result[length] = '\0';
-      remaining = qsize - length;
-      memmove(queue, p + 1, remaining);
-      qsize -= length;
-      bytes_received += length;
+      p = memchr(ring + offset, c, length);
+      return p ? p - (ring + offset) : -1;
    }
-   mtx_unlock(&mutex);
-   return result;
+   p = memchr(ring + offset, c, first);
+   if (p)
+      return p - (ring + offset);
+   p = memchr(ring, c, length - first);
+   return p ? first + (p - ring) : -1;
+}
+
+/* Contiguous view of length bytes at start. Only a message that wraps
+   around the end of the ring is copied, into a scratch buffer. */
+static char *ring_span(unsigned int start, unsigned int length)
+{
+   unsigned int offset = start & RING_MASK;
+   unsigned int first = RING_SIZE - offset;
+   if (first >= length)
+      return ring + offset;
+   if (scratch_size < length)
+   {
+      scratch_size = length;
+      scratch = realloc(scratch, scratch_size);
+   }
+   memcpy(scratch, ring + offset, first);
+   memcpy(scratch + first, ring, length - first);
+   return scratch;
+}
+
+static unsigned char ring_byte(unsigned int index)
+{
+   return (unsigned char)ring[index & RING_MASK];
+}
+
+/* Counts the complete messages in bytes received up to head, following
+   a switch to binary frames the way client_next does. recv_worker
+   scans what it receives as it arrives, so asking for the count costs
+   nothing however much is queued. */
+static void ring_count(unsigned int head)
+{
+   unsigned int next = recv_scan;
+   unsigned int count = 0;
+   int length;
+   while (!recv_binary && (length = ring_find(next, head - next, '\n')) >= 0)
+   {
+      recv_binary = length == 3 && ring_byte(next) == 'V' &&
+         ring_byte(next + 1) == ',' && ring_byte(next + 2) == '2';
+      count += !recv_binary;
+      next += length + 1;
+   }
+   while (recv_binary && head - next >= FRAME_HEADER)
+   {
+      unsigned int size = ring_byte(next + 1) |
+         ring_byte(next + 2) << 8 | ring_byte(next + 3) << 16 |
+         (unsigned int)ring_byte(next + 4) << 24;
+      if (head - next - FRAME_HEADER < size)
+         break;
+      next += FRAME_HEADER + size;
+      count++;
+   }
+   recv_scan = next;
+   if (count)
+      RING_STORE(&ring_messages, ring_messages + count);
+}
+
+/* Number of complete messages queued behind the last one handed out. */
+int client_pending(void)
+{
+   if (!client_enabled || !ring)
+      return 0;
+   return RING_LOAD(&ring_messages) - messages_read;
+}
+
+int client_next(ClientMessage *message)
+{
+   unsigned int head;
+   if (!client_enabled || !ring)
+      return 0;
+   // the previous message has been handled, hand its bytes back
+   RING_STORE(&ring_tail, ring_next);
+   head = RING_LOAD(&ring_head);
+   if (head - ring_next > max_fill)
+      max_fill = head - ring_next;
+   while (1)
+   {
+      unsigned int available = head - ring_next;
+      if (protocol == PROTOCOL_BINARY)
+      {
+         char *header;
+         int size;
+         if (available < FRAME_HEADER)
+            return 0;
+         header = ring_span(ring_next, FRAME_HEADER);
+         message->type = header[0];
+         size = client_read_int(header + 1);
+         if (size < 0 || available - FRAME_HEADER < (unsigned int)size)
+            return 0;
+         message->binary = 1;
+         message->length = size;
+         message->data = ring_span(ring_next + FRAME_HEADER, size);
+         ring_next += FRAME_HEADER + size;
+         messages_read++;
+         count_message(counters_in, message->type, FRAME_HEADER + size);
+         if (message->type == FRAME_TEXT &&
+               client_pong(message->data, size))
+            continue;
+         return 1;
+      }
+      else
+      {
+         int length = ring_find(ring_next, available, '\n');
+         char *line;
+         if (length < 0)
+            return 0;
+         // terminate the line in place of its newline
+         line = ring_span(ring_next, length + 1);
+         line[length] = '\0';
+         ring_next += length + 1;
+         if (length == 3 && !memcmp(line, "V,2", 3))
+         {
+            // the server switched to binary frames after this line
+            protocol = PROTOCOL_BINARY;
+            continue;
+         }
+         messages_read++;
+         count_message(counters_in, line[0], length + 1);
+         if (client_pong(line, length))
+            continue;
+         message->binary = 0;
+         message->type = line[0];
+         message->length = length;
+         message->data = line;
+         return 1;
+      }
+   }
+}
+
+void client_get_counters(ClientCounter *in, ClientCounter *out)
+{
+   memcpy(in, counters_in, sizeof(counters_in));
+   memcpy(out, counters_out, sizeof(counters_out));
+}
+
+void client_get_stats(ClientStats *stats)
+{
+   memset(stats, 0, sizeof(ClientStats));
+   if (!client_enabled || !ring)
+      return;
+   stats->capacity = RING_SIZE;
+   stats->fill = RING_LOAD(&ring_head) - ring_tail;
+   stats->pending = client_pending();
+   stats->max_fill = max_fill;
+   stats->stalls = stalls;
+   stats->stall_time = stall_time;
+   stats->bytes_received = bytes_received;
+   stats->bytes_sent = bytes_sent;
+   stats->send_calls = send_calls;
+   stats->send_batches = send_batches;
+   stats->send_messages = send_messages;
+   stats->positions_sent = positions_sent;
+   stats->pings = pings;
+   stats->rtt = rtt;
+   stats->average_rtt = average_rtt;
+   stats->max_rtt = max_rtt;
 }
 
 int recv_worker(void *arg)
 {
-   char *data = malloc(sizeof(char) * RECV_SIZE);
    while (1)
    {
+      unsigned int head = ring_head;
+      unsigned int offset = head & RING_MASK;
+      unsigned int space = RING_SIZE - (head - RING_LOAD(&ring_tail));
       int length;
-      if ((length = recv(sd, data, RECV_SIZE - 1, 0)) <= 0)
+      if (space == 0)
+      {
+         // the main thread is behind, wait for it to free some space
+         double start = perf_now();
+         while (running && head - RING_LOAD(&ring_tail) == RING_SIZE)
+            retro_sleep(0);
+         stalls++;
+         stall_time += perf_now() - start;
+         continue;
+      }
+      if (space > RING_SIZE - offset)
+         space = RING_SIZE - offset;
+      if ((length = recv(sd, ring + offset, space, 0)) <= 0)
       {
          if (running)
          {
@@ -205,25 +681,10 @@ int recv_worker(void *arg)
          else
             break;
       }
-      data[length] = '\0';
-
-      while (1)
-      {
-         int done = 0;
-         mtx_lock(&mutex);
-         if (qsize + length < QUEUE_SIZE)
-         {
-            memcpy(queue + qsize, data, sizeof(char) * (length + 1));
-            qsize += length;
-            done = 1;
-         }
-         mtx_unlock(&mutex);
-         if (done)
-            break;
-         retro_sleep(0);
-      }
+      bytes_received += length;
+      ring_count(head + length);
+      RING_STORE(&ring_head, head + length);
    }
-   free(data);
    return 0;
 }
 
@@ -273,34 +734,86 @@ void client_start(void)
     if (!client_enabled)
         return;
     running = 1;
-    queue = (char *)calloc(QUEUE_SIZE, sizeof(char));
-    qsize = 0;
-    mtx_init(&mutex, mtx_plain);
+    ring = (char *)calloc(RING_SIZE, sizeof(char));
+    ring_head = ring_tail = ring_next = 0;
+    ring_messages = messages_read = recv_scan = 0;
+    recv_binary = 0;
+    max_fill = stalls = 0;
+    stall_time = 0;
+    protocol = PROTOCOL_TEXT;
+    send_length = send_ready = 0;
+    send_calls = send_batches = send_messages = positions_sent = 0;
+    pings = 0;
+    rtt = average_rtt = max_rtt = 0;
+    memset(counters_in, 0, sizeof(counters_in));
+    memset(counters_out, 0, sizeof(counters_out));
 
     if (thrd_create(&recv_thread, recv_worker, NULL) != thrd_success)
     {
         perror("thrd_create");
         exit(1);
     }
+    mtx_init(&send_mtx, mtx_plain);
+    cnd_init(&send_cnd);
+    send_running = 1;
+    send_done = 0;
+    if (thrd_create(&send_thread, send_worker, NULL) != thrd_success)
+    {
+        perror("thrd_create");
+        exit(1);
+    }
 }
 
 void client_stop(void)
 {
    if (!client_enabled)
       return;
+   // from here on recv_worker takes a closed socket as the end
    running = 0;
-   close(sd);
-
-#if 0
+   // let the send thread write what is left before the socket closes
+   if (send_running)
+   {
+      double deadline = perf_now() + SEND_DEADLINE;
+      int done;
+      mtx_lock(&send_mtx);
+      send_running = 0;
+      send_ready = 1;
+      cnd_broadcast(&send_cnd);
+      done = send_done;
+      mtx_unlock(&send_mtx);
+      while (!done && perf_now() < deadline)
+      {
+         retro_sleep(10);
+         mtx_lock(&send_mtx);
+         done = send_done;
+         mtx_unlock(&send_mtx);
+      }
+      // a server that stopped reading keeps the write blocked, give up
+      // on it so the join returns
+      if (!done)
+         shutdown(sd, SHUT_RDWR);
+      thrd_join(send_thread, NULL);
+      cnd_destroy(&send_cnd);
+      mtx_destroy(&send_mtx);
+   }
+   free(send_buffer);
+   free(send_spare);
+   send_buffer = send_spare = 0;
+   send_capacity = spare_capacity = send_length = 0;
+   // recv_worker receives straight into the ring, so wake it out of recv
+   // and wait for it before the ring goes away
+   shutdown(sd, SHUT_RDWR);
    if (thrd_join(recv_thread, NULL) != thrd_success)
    {
       perror("thrd_join");
       exit(1);
    }
-   mtx_destroy(&mutex);
-#endif
-   qsize = 0;
-   free(queue);
+   close(sd);
+   free(ring);
+   ring = 0;
+   free(scratch);
+   scratch = 0;
+   scratch_size = 0;
 
 #if 0
    printf("Bytes Sent: %d, Bytes Received: %d\n",
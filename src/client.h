@@ -3,6 +3,79 @@
 
 #define DEFAULT_PORT 4080
 
+/* Protocol versions sent with V. The client always sends V,1 and then
+   asks for V,2; a server that supports it answers with a V,2 line, and
+   everything it sends after that line is binary frames:
+
+   type (1 byte), payload length (uint32), payload
+
+   Integers are little endian. B and L payloads are a run of blocks of
+   one chunk: p, q (int32), then FRAME_BLOCK bytes per block holding x
+   and z relative to the chunk origin, y and w (int16). U and P are id
+   (int32), x, y, z, rx, ry (float32), and P adds the player's velocity
+   vx, vy, vz (float32); D is id; K is p, q, key and R is
+   p, q (int32). FRAME_TEXT carries one text protocol line.
+
+   A client talking to such a server may send the edits of a chunk as
+   one text line, M,p,q followed by x,y,z,w for each block. It also asks
+   for chunks with C,p,q,key,lights,signs, the versions of everything
+   it has cached; the server answers with what changed since, ending
+   with K,p,q,key,lights,signs (int32) if anything did, and sends only
+   C,p,q when nothing has. Its positions are P,x,y,z,rx,ry,vx,vy,vz,
+   sent when they drift from what the velocity predicts rather than on
+   a timer. Receivers extrapolate a position for at most
+   MAX_EXTRAPOLATION seconds, so a moving player sends again by then.
+
+   In either protocol the server echoes Q,stamp back as a text line, so
+   the client can time the round trip. */
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_BINARY 2
+#define FRAME_HEADER 5
+#define FRAME_BLOCK 8
+#define FRAME_TEXT '#'
+#define BLOCKS 'M'
+#define PING 'Q'
+#define MAX_EXTRAPOLATION 1.0
+
+/* A received line or frame. data points into the receive queue and is
+   valid until the next call to client_next; lines are NUL terminated. */
+typedef struct {
+    int binary;
+    char type;
+    int length;
+    char *data;
+} ClientMessage;
+
+/* Receive queue counters. The stall counters are updated by the receive
+   thread and read without locking, so they are only approximate. */
+typedef struct {
+    unsigned int capacity;
+    unsigned int fill;
+    unsigned int max_fill;
+    unsigned int pending;
+    unsigned int stalls;
+    double stall_time;
+    int bytes_received;
+    int bytes_sent;
+    unsigned int send_calls;
+    unsigned int send_batches;
+    unsigned int send_messages;
+    unsigned int positions_sent;
+    unsigned int pings;
+    double rtt;
+    double average_rtt;
+    double max_rtt;
+} ClientStats;
+
+/* Messages and bytes per message type, headers and newlines included,
+   indexed by the type character. */
+#define CLIENT_TYPES 128
+
+typedef struct {
+    unsigned int count;
+    unsigned int bytes;
+} ClientCounter;
+
 void client_enable();
 void client_disable();
 int get_client_enabled();
@@ -10,12 +83,21 @@ void client_connect(char *hostname, int port);
 void client_start();
 void client_stop();
 void client_send(char *data);
-char *client_recv();
+void client_flush(void);
+int client_next(ClientMessage *message);
+int client_pending(void);
+void client_get_stats(ClientStats *stats);
+void client_get_counters(ClientCounter *in, ClientCounter *out);
+void client_ping(void);
+int client_read_int(const char *data);
+int client_read_short(const char *data);
+float client_read_float(const char *data);
 void client_version(int version);
 void client_login(const char *username, const char *identity_token);
 void client_position(float x, float y, float z, float rx, float ry);
-void client_chunk(int p, int q, int key);
+void client_chunk(int p, int q, int key, int lights, int signs);
 void client_block(int x, int y, int z, int w);
+void client_blocks(int p, int q, const int *blocks, int count);
 void client_light(int x, int y, int z, int w);
 void client_sign(int x, int y, int z, int face, const char *text);
 void client_talk(const char *text);
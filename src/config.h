@@ -33,6 +33,11 @@ extern float ANALOG_SENSITIVITY;
 extern float DEADZONE_RADIUS;
 
 extern unsigned RENDER_CHUNK_RADIUS;
+extern unsigned DB_BACKEND;
+extern unsigned DB_DURABILITY;
+extern unsigned WORLD_TERRAIN;
+extern unsigned NET_TIME_BUDGET;
+extern unsigned NET_MESSAGE_BUDGET;
 
 /* key bindings */
 #define CRAFT_KEY_FORWARD 'W'
@@ -1,10 +1,21 @@
+#include <stdio.h>
 #include <string.h>
+#include "config.h"
 #include "db.h"
+#include "perf.h"
 #include "ring.h"
 #include "sqlite3.h"
+#include "storage.h"
 #include "tinycthread.h"
 
 static int db_enabled = 0;
+static int db_backend = DB_BACKEND_SQLITE;
+static int db_durability = DB_DURABILITY_NORMAL;
+static unsigned int checkpoint_counter;
+static StorageBackend storage;
+static DbStats stats;
+
+static void db_init_storage(void);
 
 static sqlite3 *db;
 static sqlite3_stmt *insert_block_stmt;
@@ -17,6 +28,10 @@ static sqlite3_stmt *load_lights_stmt;
 static sqlite3_stmt *load_signs_stmt;
 static sqlite3_stmt *get_key_stmt;
 static sqlite3_stmt *set_key_stmt;
+static sqlite3_stmt *get_versions_stmt;
+static sqlite3_stmt *set_versions_stmt;
+static sqlite3_stmt *get_generated_stmt;
+static sqlite3_stmt *set_generated_stmt;
 
 static Ring ring;
 static thrd_t thrd;
@@ -36,6 +51,99 @@ int get_db_enabled() {
     return db_enabled;
 }
 
+void db_set_backend(int backend) {
+    db_backend = backend;
+}
+
+void db_set_durability(int durability) {
+    db_durability = durability;
+}
+
+void db_get_stats(DbStats *result) {
+    if (!db_enabled) {
+        memset(result, 0, sizeof(DbStats));
+        return;
+    }
+    mtx_lock(&load_mtx);
+    memcpy(result, &stats, sizeof(DbStats));
+    mtx_unlock(&load_mtx);
+}
+
+#define DB_SCHEMA_VERSION 1
+// commits between wal checkpoints when syncing is off
+#define DB_CHECKPOINT_COMMITS 12
+
+static int db_migrate(void)
+{
+   sqlite3_stmt *stmt;
+   char query[256];
+   int version = 0;
+   int rc = sqlite3_prepare_v2(db, "pragma user_version;", -1, &stmt, NULL);
+   if (rc) return rc;
+   if (sqlite3_step(stmt) == SQLITE_ROW)
+      version = sqlite3_column_int(stmt, 0);
+   sqlite3_finalize(stmt);
+   if (version >= DB_SCHEMA_VERSION)
+      return 0;
+   // version 1: blocks are stored once, in their own chunk. drop the
+   // neighbor padding rows older versions wrote next to every edit.
+   snprintf(query, sizeof(query),
+         "delete from block where w < 0"
+         " or p != (case when x >= 0 then x / %d else (x + 1) / %d - 1 end)"
+         " or q != (case when z >= 0 then z / %d else (z + 1) / %d - 1 end);",
+         CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE);
+   rc = sqlite3_exec(db, query, NULL, NULL, NULL);
+   if (rc) return rc;
+   snprintf(query, sizeof(query),
+         "pragma user_version = %d;", DB_SCHEMA_VERSION);
+   return sqlite3_exec(db, query, NULL, NULL, NULL);
+}
+
+static const char *db_durability_name(int durability)
+{
+   switch (durability)
+   {
+      case DB_DURABILITY_FULL:
+         return "full";
+      case DB_DURABILITY_OFF:
+         return "off";
+      case DB_DURABILITY_MEMORY:
+         return "memory";
+   }
+   return "normal";
+}
+
+static int db_set_pragmas(void)
+{
+   static const char *full_query =
+      "pragma journal_mode = delete;"
+      "pragma synchronous = full;";
+   static const char *normal_query =
+      "pragma journal_mode = wal;"
+      "pragma synchronous = normal;";
+   static const char *off_query =
+      "pragma journal_mode = wal;"
+      "pragma synchronous = off;"
+      "pragma wal_autocheckpoint = 0;";
+   static const char *memory_query =
+      "pragma journal_mode = memory;"
+      "pragma synchronous = off;";
+   const char *query = normal_query;
+   switch (db_durability)
+   {
+      case DB_DURABILITY_FULL:
+         query = full_query;
+         break;
+      case DB_DURABILITY_OFF:
+         query = off_query;
+         break;
+      case DB_DURABILITY_MEMORY:
+         query = memory_query;
+         break;
+   }
+   return sqlite3_exec(db, query, NULL, NULL, NULL);
+}
+
 int db_init(char *path)
 {
    static const char *create_query =
@@ -54,6 +162,10 @@ int db_init(char *path)
       "   rx float not null,"
       "   ry float not null"
       ");"
+      "create table if not exists option ("
+      "   name text primary key,"
+      "   value int not null"
+      ");"
       "create table if not exists block ("
       "    p int not null,"
       "    q int not null,"
@@ -75,6 +187,16 @@ int db_init(char *path)
       "    q int not null,"
       "    key int not null"
       ");"
+      "create table if not exists version ("
+      "    p int not null,"
+      "    q int not null,"
+      "    light int not null,"
+      "    sign int not null"
+      ");"
+      "create table if not exists generated ("
+      "    p int not null,"
+      "    q int not null"
+      ");"
       "create table if not exists sign ("
       "    p int not null,"
       "    q int not null,"
@@ -87,6 +209,8 @@ int db_init(char *path)
       "create unique index if not exists block_pqxyz_idx on block (p, q, x, y, z);"
       "create unique index if not exists light_pqxyz_idx on light (p, q, x, y, z);"
       "create unique index if not exists key_pq_idx on key (p, q);"
+      "create unique index if not exists version_pq_idx on version (p, q);"
+      "create unique index if not exists generated_pq_idx on generated (p, q);"
       "create unique index if not exists sign_xyzface_idx on sign (x, y, z, face);"
       "create index if not exists sign_pq_idx on sign (p, q);";
    static const char *insert_block_query =
@@ -113,14 +237,34 @@ int db_init(char *path)
    static const char *set_key_query =
       "insert or replace into key (p, q, key) "
       "values (?, ?, ?);";
+   static const char *get_versions_query =
+      "select light, sign from version where p = ? and q = ?;";
+   static const char *set_versions_query =
+      "insert or replace into version (p, q, light, sign) "
+      "values (?, ?, ?, ?);";
+   static const char *get_generated_query =
+      "select 1 from generated where p = ? and q = ?;";
+   static const char *set_generated_query =
+      "insert or replace into generated (p, q) values (?, ?);";
    int rc;
    if (!db_enabled) {
       return 0;
    }
+   if (db_durability == DB_DURABILITY_AUTO)
+      db_durability = DB_DURABILITY_NORMAL;
+   // a memory cache keeps everything, including chunks, in sqlite
+   if (db_durability == DB_DURABILITY_MEMORY) {
+      db_backend = DB_BACKEND_SQLITE;
+      path = ":memory:";
+   }
    rc = sqlite3_open(path, &db);
    if (rc) return rc;
+   rc = db_set_pragmas();
+   if (rc) return rc;
    rc = sqlite3_exec(db, create_query, NULL, NULL, NULL);
    if (rc) return rc;
+   rc = db_migrate();
+   if (rc) return rc;
    rc = sqlite3_prepare_v2(
          db, insert_block_query, -1, &insert_block_stmt, NULL);
    if (rc) return rc;
@@ -146,6 +290,27 @@ int db_init(char *path)
    if (rc) return rc;
    rc = sqlite3_prepare_v2(db, set_key_query, -1, &set_key_stmt, NULL);
    if (rc) return rc;
+   rc = sqlite3_prepare_v2(
+         db, get_versions_query, -1, &get_versions_stmt, NULL);
+   if (rc) return rc;
+   rc = sqlite3_prepare_v2(
+         db, set_versions_query, -1, &set_versions_stmt, NULL);
+   if (rc) return rc;
+   rc = sqlite3_prepare_v2(
+         db, get_generated_query, -1, &get_generated_stmt, NULL);
+   if (rc) return rc;
+   rc = sqlite3_prepare_v2(
+         db, set_generated_query, -1, &set_generated_stmt, NULL);
+   if (rc) return rc;
+   db_init_storage();
+   if (storage.open) {
+      rc = storage.open(path);
+      if (rc) return rc;
+   }
+   memset(&stats, 0, sizeof(DbStats));
+   stats.backend = storage.name;
+   stats.durability = db_durability_name(db_durability);
+   checkpoint_counter = 0;
    sqlite3_exec(db, "begin;", NULL, NULL, NULL);
    db_worker_start("");
    return 0;
@@ -156,6 +321,17 @@ void db_close(void)
     if (!db_enabled)
         return;
     db_worker_stop();
+    if (storage.close)
+        storage.close();
+    if (stats.chunk_loads)
+        printf("db: %s backend, %u chunk loads, %.3f ms per load\n",
+              stats.backend, stats.chunk_loads,
+              stats.load_time * 1000 / stats.chunk_loads);
+    if (stats.commits)
+        printf("db: %s durability, %u commits, %.3f ms avg, %.3f ms max\n",
+              stats.durability, stats.commits,
+              stats.commit_time * 1000 / stats.commits,
+              stats.max_commit_time * 1000);
     sqlite3_exec(db, "commit;", NULL, NULL, NULL);
     sqlite3_finalize(insert_block_stmt);
     sqlite3_finalize(insert_light_stmt);
@@ -167,6 +343,10 @@ void db_close(void)
     sqlite3_finalize(load_signs_stmt);
     sqlite3_finalize(get_key_stmt);
     sqlite3_finalize(set_key_stmt);
+    sqlite3_finalize(get_versions_stmt);
+    sqlite3_finalize(set_versions_stmt);
+    sqlite3_finalize(get_generated_stmt);
+    sqlite3_finalize(set_generated_stmt);
     sqlite3_close(db);
 }
 
@@ -180,9 +360,28 @@ void db_commit(void)
     mtx_unlock(&mtx);
 }
 
-void _db_commit(void)
+static void _db_commit(void)
 {
-    sqlite3_exec(db, "commit; begin;", NULL, NULL, NULL);
+    double elapsed;
+    double start = perf_now();
+    sqlite3_exec(db, "commit;", NULL, NULL, NULL);
+    if (db_durability == DB_DURABILITY_OFF &&
+          ++checkpoint_counter >= DB_CHECKPOINT_COMMITS) {
+        checkpoint_counter = 0;
+        sqlite3_exec(db, "pragma wal_checkpoint(passive);",
+              NULL, NULL, NULL);
+    }
+    sqlite3_exec(db, "begin;", NULL, NULL, NULL);
+    if (storage.commit)
+        storage.commit(db_durability == DB_DURABILITY_FULL);
+    elapsed = perf_now() - start;
+    mtx_lock(&load_mtx);
+    stats.commits++;
+    stats.commit_time += elapsed;
+    stats.last_commit_time = elapsed;
+    if (elapsed > stats.max_commit_time)
+        stats.max_commit_time = elapsed;
+    mtx_unlock(&load_mtx);
 }
 
 void db_auth_set(char *username, char *identity_token)
@@ -312,6 +511,36 @@ int db_load_state(float *x, float *y, float *z, float *rx, float *ry)
    return result;
 }
 
+int db_get_option(const char *name, int fallback)
+{
+   static const char *query =
+      "select value from option where name = ?;";
+   int result = fallback;
+   sqlite3_stmt *stmt;
+   if (!db_enabled)
+      return fallback;
+   sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+   sqlite3_bind_text(stmt, 1, name, -1, NULL);
+   if (sqlite3_step(stmt) == SQLITE_ROW)
+      result = sqlite3_column_int(stmt, 0);
+   sqlite3_finalize(stmt);
+   return result;
+}
+
+void db_set_option(const char *name, int value)
+{
+   static const char *query =
+      "insert or replace into option (name, value) values (?, ?);";
+   sqlite3_stmt *stmt;
+   if (!db_enabled)
+      return;
+   sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+   sqlite3_bind_text(stmt, 1, name, -1, NULL);
+   sqlite3_bind_int(stmt, 2, value);
+   sqlite3_step(stmt);
+   sqlite3_finalize(stmt);
+}
+
 void db_insert_block(int p, int q, int x, int y, int z, int w)
 {
    if (!db_enabled)
@@ -322,7 +551,21 @@ void db_insert_block(int p, int q, int x, int y, int z, int w)
    mtx_unlock(&mtx);
 }
 
-void _db_insert_block(int p, int q, int x, int y, int z, int w) {
+/* blocks holds x, y, z, w for each of count blocks of chunk (p, q),
+   queued under one lock for the writer thread. */
+void db_insert_blocks(int p, int q, const int *blocks, int count)
+{
+   int i;
+   if (!db_enabled)
+      return;
+   mtx_lock(&mtx);
+   for (i = 0; i < count; i++, blocks += 4)
+      ring_put_block(&ring, p, q, blocks[0], blocks[1], blocks[2], blocks[3]);
+   cnd_signal(&cnd);
+   mtx_unlock(&mtx);
+}
+
+static void sqlite_insert_block(int p, int q, int x, int y, int z, int w) {
     sqlite3_reset(insert_block_stmt);
     sqlite3_bind_int(insert_block_stmt, 1, p);
     sqlite3_bind_int(insert_block_stmt, 2, q);
@@ -342,7 +585,7 @@ void db_insert_light(int p, int q, int x, int y, int z, int w) {
     mtx_unlock(&mtx);
 }
 
-void _db_insert_light(int p, int q, int x, int y, int z, int w) {
+static void sqlite_insert_light(int p, int q, int x, int y, int z, int w) {
     sqlite3_reset(insert_light_stmt);
     sqlite3_bind_int(insert_light_stmt, 1, p);
     sqlite3_bind_int(insert_light_stmt, 2, q);
@@ -358,6 +601,12 @@ void db_insert_sign(
 {
     if (!db_enabled)
         return;
+    storage.insert_sign(p, q, x, y, z, face, text);
+}
+
+static void sqlite_insert_sign(
+    int p, int q, int x, int y, int z, int face, const char *text)
+{
     sqlite3_reset(insert_sign_stmt);
     sqlite3_bind_int(insert_sign_stmt, 1, p);
     sqlite3_bind_int(insert_sign_stmt, 2, q);
@@ -372,6 +621,10 @@ void db_insert_sign(
 void db_delete_sign(int x, int y, int z, int face) {
     if (!db_enabled)
         return;
+    storage.delete_sign(x, y, z, face);
+}
+
+static void sqlite_delete_sign(int x, int y, int z, int face) {
     sqlite3_reset(delete_sign_stmt);
     sqlite3_bind_int(delete_sign_stmt, 1, x);
     sqlite3_bind_int(delete_sign_stmt, 2, y);
@@ -383,6 +636,10 @@ void db_delete_sign(int x, int y, int z, int face) {
 void db_delete_signs(int x, int y, int z) {
     if (!db_enabled)
         return;
+    storage.delete_signs(x, y, z);
+}
+
+static void sqlite_delete_signs(int x, int y, int z) {
     sqlite3_reset(delete_signs_stmt);
     sqlite3_bind_int(delete_signs_stmt, 1, x);
     sqlite3_bind_int(delete_signs_stmt, 2, y);
@@ -393,13 +650,28 @@ void db_delete_signs(int x, int y, int z) {
 void db_delete_all_signs() {
     if (!db_enabled)
         return;
+    storage.delete_all_signs();
+}
+
+static void sqlite_delete_all_signs(void) {
     sqlite3_exec(db, "delete from sign;", NULL, NULL, NULL);
+    // the signs have to be sent again
+    sqlite3_exec(db, "update version set sign = 0;", NULL, NULL, NULL);
 }
 
 void db_load_blocks(Map *map, int p, int q) {
+    double start;
     if (!db_enabled)
         return;
     mtx_lock(&load_mtx);
+    start = perf_now();
+    storage.load_blocks(map, p, q);
+    stats.chunk_loads++;
+    stats.load_time += perf_now() - start;
+    mtx_unlock(&load_mtx);
+}
+
+static void sqlite_load_blocks(Map *map, int p, int q) {
     sqlite3_reset(load_blocks_stmt);
     sqlite3_bind_int(load_blocks_stmt, 1, p);
     sqlite3_bind_int(load_blocks_stmt, 2, q);
@@ -410,13 +682,20 @@ void db_load_blocks(Map *map, int p, int q) {
         int w = sqlite3_column_int(load_blocks_stmt, 3);
         map_set(map, x, y, z, w);
     }
-    mtx_unlock(&load_mtx);
 }
 
 void db_load_lights(Map *map, int p, int q) {
+    double start;
     if (!db_enabled)
         return;
     mtx_lock(&load_mtx);
+    start = perf_now();
+    storage.load_lights(map, p, q);
+    stats.load_time += perf_now() - start;
+    mtx_unlock(&load_mtx);
+}
+
+static void sqlite_load_lights(Map *map, int p, int q) {
     sqlite3_reset(load_lights_stmt);
     sqlite3_bind_int(load_lights_stmt, 1, p);
     sqlite3_bind_int(load_lights_stmt, 2, q);
@@ -427,12 +706,15 @@ void db_load_lights(Map *map, int p, int q) {
         int w = sqlite3_column_int(load_lights_stmt, 3);
         map_set(map, x, y, z, w);
     }
-    mtx_unlock(&load_mtx);
 }
 
 void db_load_signs(SignList *list, int p, int q) {
     if (!db_enabled)
         return;
+    storage.load_signs(list, p, q);
+}
+
+static void sqlite_load_signs(SignList *list, int p, int q) {
     sqlite3_reset(load_signs_stmt);
     sqlite3_bind_int(load_signs_stmt, 1, p);
     sqlite3_bind_int(load_signs_stmt, 2, q);
@@ -450,6 +732,10 @@ void db_load_signs(SignList *list, int p, int q) {
 int db_get_key(int p, int q) {
     if (!db_enabled)
         return 0;
+    return storage.get_key(p, q);
+}
+
+static int sqlite_get_key(int p, int q) {
     sqlite3_reset(get_key_stmt);
     sqlite3_bind_int(get_key_stmt, 1, p);
     sqlite3_bind_int(get_key_stmt, 2, q);
@@ -468,7 +754,7 @@ void db_set_key(int p, int q, int key) {
     mtx_unlock(&mtx);
 }
 
-void _db_set_key(int p, int q, int key) {
+static void sqlite_set_key(int p, int q, int key) {
     sqlite3_reset(set_key_stmt);
     sqlite3_bind_int(set_key_stmt, 1, p);
     sqlite3_bind_int(set_key_stmt, 2, q);
@@ -476,6 +762,119 @@ void _db_set_key(int p, int q, int key) {
     sqlite3_step(set_key_stmt);
 }
 
+/* Versions of the lights and signs of a chunk as last sent by the
+   server, alongside its block key. Always kept in sqlite. */
+void db_get_versions(int p, int q, int *lights, int *signs) {
+    *lights = *signs = 0;
+    if (!db_enabled)
+        return;
+    sqlite3_reset(get_versions_stmt);
+    sqlite3_bind_int(get_versions_stmt, 1, p);
+    sqlite3_bind_int(get_versions_stmt, 2, q);
+    if (sqlite3_step(get_versions_stmt) == SQLITE_ROW) {
+        *lights = sqlite3_column_int(get_versions_stmt, 0);
+        *signs = sqlite3_column_int(get_versions_stmt, 1);
+    }
+}
+
+void db_set_versions(int p, int q, int lights, int signs) {
+    if (!db_enabled)
+        return;
+    mtx_lock(&mtx);
+    ring_put_versions(&ring, p, q, lights, signs);
+    cnd_signal(&cnd);
+    mtx_unlock(&mtx);
+}
+
+static void _db_set_versions(int p, int q, int lights, int signs) {
+    sqlite3_reset(set_versions_stmt);
+    sqlite3_bind_int(set_versions_stmt, 1, p);
+    sqlite3_bind_int(set_versions_stmt, 2, q);
+    sqlite3_bind_int(set_versions_stmt, 3, lights);
+    sqlite3_bind_int(set_versions_stmt, 4, signs);
+    sqlite3_step(set_versions_stmt);
+}
+
+int db_get_generated(int p, int q) {
+    int result;
+    if (!db_enabled)
+        return 0;
+    mtx_lock(&load_mtx);
+    result = storage.get_generated(p, q);
+    mtx_unlock(&load_mtx);
+    return result;
+}
+
+static int sqlite_get_generated(int p, int q) {
+    sqlite3_reset(get_generated_stmt);
+    sqlite3_bind_int(get_generated_stmt, 1, p);
+    sqlite3_bind_int(get_generated_stmt, 2, q);
+    return sqlite3_step(get_generated_stmt) == SQLITE_ROW;
+}
+
+static void sqlite_set_generated(int p, int q) {
+    sqlite3_reset(set_generated_stmt);
+    sqlite3_bind_int(set_generated_stmt, 1, p);
+    sqlite3_bind_int(set_generated_stmt, 2, q);
+    sqlite3_step(set_generated_stmt);
+}
+
+// writes a whole generated chunk from the calling thread, bypassing the
+// worker queue. meant for offline tools, not for use alongside edits.
+// only the chunk's own blocks are written, not the padding around it.
+void db_insert_chunk(int p, int q, Map *map) {
+    int x0 = p * CHUNK_SIZE;
+    int z0 = q * CHUNK_SIZE;
+    if (!db_enabled)
+        return;
+    mtx_lock(&load_mtx);
+    MAP_FOR_EACH(map, ex, ey, ez, ew) {
+        if (ew < 0 || ex < x0 || ez < z0 ||
+            ex >= x0 + CHUNK_SIZE || ez >= z0 + CHUNK_SIZE)
+            continue;
+        storage.insert_block(p, q, ex, ey, ez, ew);
+    } END_MAP_FOR_EACH;
+    storage.set_generated(p, q);
+    mtx_unlock(&load_mtx);
+}
+
+static const StorageBackend sqlite_backend = {
+    "sqlite",
+    NULL,
+    NULL,
+    NULL,
+    sqlite_insert_block,
+    sqlite_insert_light,
+    sqlite_insert_sign,
+    sqlite_delete_sign,
+    sqlite_delete_signs,
+    sqlite_delete_all_signs,
+    sqlite_load_blocks,
+    sqlite_load_lights,
+    sqlite_load_signs,
+    sqlite_get_key,
+    sqlite_set_key,
+    sqlite_get_generated,
+    sqlite_set_generated
+};
+
+static void db_init_storage(void) {
+    if (db_backend == DB_BACKEND_REGION)
+        memcpy(&storage, &region_backend, sizeof(StorageBackend));
+    else
+        memcpy(&storage, &sqlite_backend, sizeof(StorageBackend));
+    if (!storage.insert_sign)
+        storage.insert_sign = sqlite_insert_sign;
+    if (!storage.delete_sign)
+        storage.delete_sign = sqlite_delete_sign;
+    if (!storage.delete_signs)
+        storage.delete_signs = sqlite_delete_signs;
+    if (!storage.delete_all_signs)
+        storage.delete_all_signs = sqlite_delete_all_signs;
+    if (!storage.load_signs)
+        storage.load_signs = sqlite_load_signs;
+}
+
 void db_worker_start(char *path) {
     if (!db_enabled)
         return;
@@ -513,13 +912,16 @@ int db_worker_run(void *arg) {
        switch (e.type)
        {
           case BLOCK:
-             _db_insert_block(e.p, e.q, e.x, e.y, e.z, e.w);
+             storage.insert_block(e.p, e.q, e.x, e.y, e.z, e.w);
              break;
           case LIGHT:
-             _db_insert_light(e.p, e.q, e.x, e.y, e.z, e.w);
+             storage.insert_light(e.p, e.q, e.x, e.y, e.z, e.w);
              break;
           case KEY:
-             _db_set_key(e.p, e.q, e.key);
+             storage.set_key(e.p, e.q, e.key);
+             break;
+          case VERSIONS:
+             _db_set_versions(e.p, e.q, e.key, e.w);
              break;
           case COMMIT:
              _db_commit();
@@ -4,9 +4,32 @@
 #include "map.h"
 #include "sign.h"
 
+#define DB_BACKEND_SQLITE 0
+#define DB_BACKEND_REGION 1
+
+#define DB_DURABILITY_AUTO 0
+#define DB_DURABILITY_FULL 1
+#define DB_DURABILITY_NORMAL 2
+#define DB_DURABILITY_OFF 3
+#define DB_DURABILITY_MEMORY 4
+
+typedef struct {
+    const char *backend;
+    const char *durability;
+    unsigned int chunk_loads;
+    double load_time;
+    unsigned int commits;
+    double commit_time;
+    double last_commit_time;
+    double max_commit_time;
+} DbStats;
+
 void db_enable();
 void db_disable();
 int get_db_enabled();
+void db_set_backend(int backend);
+void db_set_durability(int durability);
+void db_get_stats(DbStats *stats);
 int db_init(char *path);
 void db_close();
 void db_commit();
@@ -21,7 +44,10 @@ int db_auth_get_selected(
     char *identity_token, int identity_token_length);
 void db_save_state(float x, float y, float z, float rx, float ry);
 int db_load_state(float *x, float *y, float *z, float *rx, float *ry);
+int db_get_option(const char *name, int fallback);
+void db_set_option(const char *name, int value);
 void db_insert_block(int p, int q, int x, int y, int z, int w);
+void db_insert_blocks(int p, int q, const int *blocks, int count);
 void db_insert_light(int p, int q, int x, int y, int z, int w);
 void db_insert_sign(
     int p, int q, int x, int y, int z, int face, const char *text);
@@ -33,6 +59,10 @@ void db_load_lights(Map *map, int p, int q);
 void db_load_signs(SignList *list, int p, int q);
 int db_get_key(int p, int q);
 void db_set_key(int p, int q, int key);
+void db_get_versions(int p, int q, int *lights, int *signs);
+void db_set_versions(int p, int q, int lights, int signs);
+int db_get_generated(int p, int q);
+void db_insert_chunk(int p, int q, Map *map);
 void db_worker_start(char *path);
 void db_worker_stop(void);
 int db_worker_run(void *arg);
@@ -18,6 +18,8 @@
 #include "map.h"
 #include "matrix.h"
 #include <noise.h>
+#include "perf.h"
+#include "protocol.h"
 #include "sign.h"
 #include "util.h"
 #include <tinycthread.h>
@@ -48,6 +50,11 @@ unsigned FIELD_OF_VIEW = 90;
 unsigned INVERTED_AIM = 1;
 float ANALOG_SENSITIVITY = 0.0200;
 float DEADZONE_RADIUS = 0.040;
+unsigned DB_BACKEND = 0;
+unsigned DB_DURABILITY = 0;
+unsigned WORLD_TERRAIN = 0;
+unsigned NET_TIME_BUDGET = 4;
+unsigned NET_MESSAGE_BUDGET = 0;
 
 #define MAX_CHUNKS 8192
 #define MAX_PLAYERS 128
@@ -55,6 +62,8 @@ float DEADZONE_RADIUS = 0.040;
 #define MAX_TEXT_LENGTH 256
 #define MAX_PATH_LENGTH 256
 #define MAX_ADDR_LENGTH 256
+#define PING_INTERVAL 1.0
+#define RECKON_BLEND 0.1
 
 #define ALIGN_LEFT 0
 #define ALIGN_CENTER 1
@@ -78,8 +87,10 @@ typedef struct {
     int dirty;
     int miny;
     int maxy;
-    uintptr_t buffer;
+    int cloud_faces;
+    RendererSlot buffer;
     uintptr_t sign_buffer;
+    RendererSlot cloud_buffer;
 } Chunk;
 
 typedef struct {
@@ -92,6 +103,8 @@ typedef struct {
     int maxy;
     int faces;
     float *data;
+    int cloud_faces;
+    float *cloud_data;
 } WorkerItem;
 
 typedef struct {
@@ -554,6 +567,21 @@ static void draw_triangles_3d_ao(Attrib *attrib, uintptr_t buffer, int count) {
    renderer_unbind_array_buffer(attrib, normal_enable, uv_enable);
 }
 
+// slots next to each other in one arena are drawn without rebinding
+static void draw_slot_3d_ao(
+      Attrib *attrib, RendererSlot *slot, int count, uintptr_t *bound) {
+   unsigned attrib_size   = 3;
+   unsigned normal_enable = 1;
+   unsigned uv_enable     = 1;
+
+   if (slot->buffer != *bound) {
+      renderer_bind_array_buffer(attrib, slot->buffer, normal_enable, uv_enable);
+      renderer_modify_array_buffer(attrib, attrib_size, normal_enable, uv_enable, 10);
+      *bound = slot->buffer;
+   }
+   renderer_draw_triangle_range(DRAW_PRIM_TRIANGLES, slot->first, count);
+}
+
 static void draw_triangles_3d_text(Attrib *attrib, uintptr_t buffer, int count) {
    unsigned attrib_size   = 3;
    unsigned normal_enable = 0;
@@ -635,12 +663,50 @@ static void update_player(Player *player,
     }
 }
 
+// Starts a player moving from where it is drawn along the velocity
+// the server sent with its position, correcting the difference over
+// RECKON_BLEND seconds.
+static void reckon_player(Player *player,
+    float x, float y, float z, float rx, float ry,
+    float vx, float vy, float vz)
+{
+   State *s1 = &player->state1;
+   State *s2 = &player->state2;
+   memcpy(s1, &player->state, sizeof(State));
+   s2->x = x; s2->y = y; s2->z = z; s2->rx = rx; s2->ry = ry;
+   s1->t = s2->t = glfwGetTime();
+   if (s2->rx - s1->rx > PI)
+      s1->rx += 2 * PI;
+   if (s1->rx - s2->rx > PI)
+      s1->rx -= 2 * PI;
+   player->vx = vx;
+   player->vy = vy;
+   player->vz = vz;
+   player->reckoned = 1;
+}
+
 static void interpolate_player(Player *player)
 {
    float p, t1, t2;
    State *s1 = &player->state1;
    State *s2 = &player->state2;
 
+   if (player->reckoned) {
+      // the clock jumps when the server sets the time of day
+      t2 = MAX(glfwGetTime() - s2->t, 0);
+      t1 = MIN(t2, MAX_EXTRAPOLATION);
+      p = MIN(t2 / RECKON_BLEND, 1);
+      update_player(
+            player,
+            s1->x + player->vx * t1 + (s2->x - s1->x) * p,
+            s1->y + player->vy * t1 + (s2->y - s1->y) * p,
+            s1->z + player->vz * t1 + (s2->z - s1->z) * p,
+            s1->rx + (s2->rx - s1->rx) * p,
+            s1->ry + (s2->ry - s1->ry) * p,
+            0);
+      return;
+   }
+
    t1 = s2->t - s1->t;
    t2 = glfwGetTime() - s2->t;
    t1 = MIN(t1, 1);
@@ -1128,6 +1194,27 @@ static void dirty_chunk(Chunk *chunk)
    }
 }
 
+// neighbors meshed before chunk loaded took their border from generated
+// terrain, without the edits stored in chunk, so they are meshed again.
+// the others are still dirty from init_chunk anyway
+static void dirty_meshed_neighbors(Chunk *chunk)
+{
+   int dp, dq;
+
+   for (dp = -1; dp <= 1; dp++)
+   {
+      for (dq = -1; dq <= 1; dq++)
+      {
+         Chunk *other;
+         if (!dp && !dq)
+            continue;
+         other = find_chunk(chunk->p + dp, chunk->q + dq);
+         if (other)
+            other->dirty = 1;
+      }
+   }
+}
+
 static void occlusion(
     int8_t neighbors[27], int8_t lights[27], float shades[27],
     float ao[6][4], float light[6][4])
@@ -1257,6 +1344,16 @@ static void compute_chunk(WorkerItem *item)
             if (x >= XZ_SIZE || y >= Y_SIZE || z >= XZ_SIZE)
                continue;
             // END TODO
+            // padding is only generated terrain, edits live in the
+            // owning chunk, so prefer the owner's map when we have it
+            if (w < 0 && x > 0 && z > 0 &&
+                  x <= CHUNK_SIZE * 3 && z <= CHUNK_SIZE * 3)
+            {
+               unsigned oa = (x - 1) / CHUNK_SIZE;
+               unsigned ob = (z - 1) / CHUNK_SIZE;
+               if ((oa != a || ob != b) && item->block_maps[oa][ob])
+                  continue;
+            }
             opaque[XYZ(x, y, z)] = !is_transparent(w);
             if (opaque[XYZ(x, y, z)])
                highest[XZ(x, z)] = MAX(highest[XZ(x, z)], y);
@@ -1410,8 +1507,7 @@ static void generate_chunk(Chunk *chunk, WorkerItem *item) {
     chunk->miny = item->miny;
     chunk->maxy = item->maxy;
     chunk->faces = item->faces;
-    renderer_del_buffer(chunk->buffer);
-    chunk->buffer = renderer_gen_faces(10, item->faces, item->data);
+    renderer_upload_faces(&chunk->buffer, item->faces, item->data);
     gen_sign_buffer(chunk);
 }
 
@@ -1456,21 +1552,106 @@ static void map_set_func(int x, int y, int z, int w, void *arg)
     map_set(map, x, y, z, w);
 }
 
+static void map_fill_func(int x, int z, int y0, int y1, int w, void *arg)
+{
+    Map *map = (Map *)arg;
+    map_fill(map, x, z, y0, y1, w);
+}
+
+#define CLOUD_MASK(a, b) clouds[(a) * CLOUD_WIDTH + (b)]
+
+static void compute_clouds(WorkerItem *item)
+{
+   unsigned char clouds[CLOUD_WIDTH * CLOUD_WIDTH];
+   float ao[6][4] = {{0}};
+   float light[6][4] = {{0}};
+   int count = create_clouds(item->p, item->q, clouds);
+   int faces = 0;
+   int pass, a, b;
+   float *data = 0;
+   item->cloud_faces = 0;
+   item->cloud_data = 0;
+   if (!count)
+      return;
+   // count exposed faces, then generate geometry
+   for (pass = 0; pass < 2; pass++)
+   {
+      int offset = 0;
+      if (pass)
+         data = malloc_faces(10, faces);
+      for (a = 1; a <= CHUNK_SIZE; a++)
+      {
+         for (b = 1; b <= CHUNK_SIZE; b++)
+         {
+            int mask = CLOUD_MASK(a, b);
+            int k;
+            for (k = 0; mask >> k; k++)
+            {
+               int f1, f2, f3, f4, f5, f6, total;
+               if (!((mask >> k) & 1))
+                  continue;
+               f1 = !((CLOUD_MASK(a - 1, b) >> k) & 1);
+               f2 = !((CLOUD_MASK(a + 1, b) >> k) & 1);
+               f3 = !((mask >> (k + 1)) & 1);
+               f4 = k == 0 || !((mask >> (k - 1)) & 1);
+               f5 = !((CLOUD_MASK(a, b - 1) >> k) & 1);
+               f6 = !((CLOUD_MASK(a, b + 1) >> k) & 1);
+               total = f1 + f2 + f3 + f4 + f5 + f6;
+               if (!pass)
+               {
+                  faces += total;
+                  continue;
+               }
+               if (total == 0)
+                  continue;
+               make_cube(
+                     data + offset, ao, light,
+                     f1, f2, f3, f4, f5, f6,
+                     item->p * CHUNK_SIZE - 1 + a, CLOUD_LO + k,
+                     item->q * CHUNK_SIZE - 1 + b, 0.5, CLOUD);
+               offset += total * 60;
+            }
+         }
+      }
+   }
+   item->cloud_faces = faces;
+   item->cloud_data = data;
+}
+
+#undef CLOUD_MASK
+
+static void generate_clouds(Chunk *chunk, WorkerItem *item)
+{
+   chunk->cloud_faces = item->cloud_faces;
+   if (item->cloud_data)
+      renderer_upload_faces(
+            &chunk->cloud_buffer, item->cloud_faces, item->cloud_data);
+   else
+      renderer_free_slot(&chunk->cloud_buffer);
+}
+
 static void load_chunk(WorkerItem *item)
 {
     int p = item->p;
     int q = item->q;
     Map *block_map = item->block_maps[1][1];
     Map *light_map = item->light_maps[1][1];
-    create_world(p, q, map_set_func, block_map);
+    if (!db_get_generated(p, q))
+        create_world_fill(p, q, map_set_func, map_fill_func, block_map);
+    else
+        // pregenerated chunks are stored without their padding
+        create_world_padding(p, q, map_set_func, map_fill_func, block_map);
     db_load_blocks(block_map, p, q);
     db_load_lights(light_map, p, q);
+    compute_clouds(item);
 }
 
 static void request_chunk(int p, int q)
 {
+   int lights, signs;
    int key = db_get_key(p, q);
-   client_chunk(p, q, key);
+   db_get_versions(p, q, &lights, &signs);
+   client_chunk(p, q, key, lights, signs);
 }
 
 static void init_chunk(Chunk *chunk, int p, int q)
@@ -1484,8 +1665,10 @@ static void init_chunk(Chunk *chunk, int p, int q)
    chunk->q = q;
    chunk->faces = 0;
    chunk->sign_faces = 0;
-   chunk->buffer = 0;
+   chunk->cloud_faces = 0;
+   memset(&chunk->buffer, 0, sizeof(RendererSlot));
    chunk->sign_buffer = 0;
+   memset(&chunk->cloud_buffer, 0, sizeof(RendererSlot));
    dirty_chunk(chunk);
    signs = &chunk->signs;
    sign_list_alloc(signs, 16);
@@ -1512,6 +1695,7 @@ static void create_chunk(Chunk *chunk, int p, int q)
    item->block_maps[1][1] = &chunk->map;
    item->light_maps[1][1] = &chunk->lights;
    load_chunk(item);
+   generate_clouds(chunk, item);
 
    request_chunk(p, q);
 }
@@ -1550,8 +1734,9 @@ static void delete_chunks(void)
          map_free(&chunk->map);
          map_free(&chunk->lights);
          sign_list_free(&chunk->signs);
-         renderer_del_buffer(chunk->buffer);
+         renderer_free_slot(&chunk->buffer);
          renderer_del_buffer(chunk->sign_buffer);
+         renderer_free_slot(&chunk->cloud_buffer);
          other = g->chunks + (--count);
          memcpy(chunk, other, sizeof(Chunk));
       }
@@ -1569,8 +1754,9 @@ static void delete_all_chunks(void)
       map_free(&chunk->map);
       map_free(&chunk->lights);
       sign_list_free(&chunk->signs);
-      renderer_del_buffer(chunk->buffer);
+      renderer_free_slot(&chunk->buffer);
       renderer_del_buffer(chunk->sign_buffer);
+      renderer_free_slot(&chunk->cloud_buffer);
    }
    g->chunk_count = 0;
 }
@@ -1598,10 +1784,14 @@ static void check_workers(void)
                map_free(&chunk->lights);
                map_copy(&chunk->map, block_map);
                map_copy(&chunk->lights, light_map);
+               generate_clouds(chunk, item);
                request_chunk(item->p, item->q);
+               dirty_meshed_neighbors(chunk);
             }
             generate_chunk(chunk, item);
          }
+         else if (item->load)
+            free(item->cloud_data);
          for (a = 0; a < 3; a++)
          {
             int b;
@@ -1702,7 +1892,7 @@ static void ensure_chunks_worker(Player *player, Worker *worker)
             distance = MAX(ABS(dp), ABS(dq));
             invisible = !chunk_visible(planes, a, b, 0, MAX_BLOCK_HEIGHT);
             if (chunk)
-               priority = chunk->buffer && chunk->dirty;
+               priority = chunk->buffer.buffer && chunk->dirty;
             score = (invisible << 24) | (priority << 16) | distance;
             if (score < best_score)
             {
@@ -1910,6 +2100,29 @@ static void set_light(int p, int q, int x, int y, int z, int w)
       db_insert_light(p, q, x, y, z, w);
 }
 
+static void dirty_border(int p, int q, int x, int z)
+{
+   int dx;
+
+   for (dx = -1; dx <= 1; dx++)
+   {
+      int dz;
+      for (dz = -1; dz <= 1; dz++)
+      {
+         Chunk *other;
+         if (dx == 0 && dz == 0)
+            continue;
+         if (dx && chunked(x + dx) == p)
+            continue;
+         if (dz && chunked(z + dz) == q)
+            continue;
+         other = find_chunk(p + dx, q + dz);
+         if (other)
+            dirty_chunk(other);
+      }
+   }
+}
+
 static void _set_block(int p, int q, int x, int y, int z, int w, int dirty)
 {
     Chunk *chunk = find_chunk(p, q);
@@ -1920,6 +2133,8 @@ static void _set_block(int p, int q, int x, int y, int z, int w, int dirty)
         {
             if (dirty)
                 dirty_chunk(chunk);
+            // neighbors derive their padding from this map
+            dirty_border(p, q, x, z);
             db_insert_block(p, q, x, y, z, w);
         }
     }
@@ -1935,26 +2150,10 @@ static void _set_block(int p, int q, int x, int y, int z, int w, int dirty)
 
 static void set_block(int x, int y, int z, int w)
 {
-   int dx;
    int p = chunked(x);
    int q = chunked(z);
 
    _set_block(p, q, x, y, z, w, 1);
-
-   for (dx = -1; dx <= 1; dx++)
-   {
-      int dz;
-      for (dz = -1; dz <= 1; dz++)
-      {
-         if (dx == 0 && dz == 0)
-            continue;
-         if (dx && chunked(x + dx) == p)
-            continue;
-         if (dz && chunked(z + dz) == q)
-            continue;
-         _set_block(p + dx, q + dz, x, y, z, -w, 1);
-      }
-   }
    client_block(x, y, z, w);
 }
 
@@ -1982,10 +2181,175 @@ static int get_block(int x, int y, int z)
     return 0;
 }
 
+/* Builder commands gather their edits per chunk between edit_begin and
+   edit_end instead of applying each block on its own. edit_end applies
+   a chunk's edits in one pass, dirties it and its touched neighbours
+   once, queues the blocks for the database together, commits them as
+   one transaction and sends them to the server as one message. */
+typedef struct {
+   int p;
+   int q;
+   int size;
+   int capacity;
+   int *data; // x, y, z, w per edit
+   Map pending; // w + 1 of the last edit of each block, for lookups
+} EditList;
+
+static EditList *edits = NULL;
+static int edit_count = 0;
+static int edit_capacity = 0;
+static int edit_last = 0;
+static int edit_depth = 0;
+
+static void edit_begin(void)
+{
+   edit_depth++;
+}
+
+static EditList *edit_list(int p, int q)
+{
+   EditList *list;
+   int i;
+   if (edit_last < edit_count &&
+         edits[edit_last].p == p && edits[edit_last].q == q)
+      return edits + edit_last;
+   for (i = 0; i < edit_count; i++)
+   {
+      if (edits[i].p == p && edits[i].q == q)
+      {
+         edit_last = i;
+         return edits + i;
+      }
+   }
+   if (edit_count == edit_capacity)
+   {
+      edit_capacity = edit_capacity ? edit_capacity * 2 : 16;
+      edits = (EditList*)realloc(edits, sizeof(EditList) * edit_capacity);
+   }
+   list = edits + edit_count;
+   memset(list, 0, sizeof(EditList));
+   list->p = p;
+   list->q = q;
+   map_alloc(&list->pending, p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0xff);
+   edit_last = edit_count++;
+   return list;
+}
+
+// the block at x, y, z as the edits gathered so far leave it
+static int edit_get_block(EditList *list, int x, int y, int z)
+{
+   int w = map_get(&list->pending, x, y, z);
+   return w ? w - 1 : get_block(x, y, z);
+}
+
+static void edit_block(EditList *list, int x, int y, int z, int w)
+{
+   int *e;
+   if (list->size == list->capacity)
+   {
+      list->capacity = list->capacity ? list->capacity * 2 : 256;
+      list->data = (int*)realloc(list->data, sizeof(int) * 4 * list->capacity);
+   }
+   e = list->data + list->size++ * 4;
+   e[0] = x;
+   e[1] = y;
+   e[2] = z;
+   e[3] = w;
+   map_set(&list->pending, x, y, z, w + 1);
+}
+
+static void edit_apply(EditList *list)
+{
+   int i, dp, dq;
+   int border = 0; // bit (dp + 1) * 3 + dq + 1 for each touched neighbour
+   int p = list->p;
+   int q = list->q;
+   Chunk *chunk = find_chunk(p, q);
+   if (!chunk)
+   {
+      for (i = 0; i < list->size; i++)
+      {
+         int *e = list->data + i * 4;
+         if (e[3] == 0)
+         {
+            unset_sign(e[0], e[1], e[2]);
+            db_insert_light(p, q, e[0], e[1], e[2], 0);
+         }
+      }
+      db_insert_blocks(p, q, list->data, list->size);
+      return;
+   }
+   for (i = 0; i < list->size; i++)
+   {
+      int *e = list->data + i * 4;
+      int x = e[0], y = e[1], z = e[2], w = e[3];
+      if (map_set(&chunk->map, x, y, z, w))
+      {
+         int ex = chunked(x - 1) != p ? -1 : chunked(x + 1) != p ? 1 : 0;
+         int ez = chunked(z - 1) != q ? -1 : chunked(z + 1) != q ? 1 : 0;
+         border |= 1 << ((ex + 1) * 3 + 1);
+         border |= 1 << (4 + ez);
+         border |= 1 << ((ex + 1) * 3 + ez + 1);
+      }
+      if (w == 0)
+      {
+         if (sign_list_remove_all(&chunk->signs, x, y, z))
+            db_delete_signs(x, y, z);
+         if (map_set(&chunk->lights, x, y, z, 0))
+         {
+            // the light reached into the neighbours
+            border = 0x1ff;
+            db_insert_light(p, q, x, y, z, 0);
+         }
+      }
+   }
+   db_insert_blocks(p, q, list->data, list->size);
+   dirty_chunk(chunk);
+   for (dp = -1; dp <= 1; dp++)
+   {
+      for (dq = -1; dq <= 1; dq++)
+      {
+         Chunk *other;
+         if ((dp || dq) && (border & (1 << ((dp + 1) * 3 + dq + 1))) &&
+               (other = find_chunk(p + dp, q + dq)))
+            other->dirty = 1;
+      }
+   }
+}
+
+static void edit_end(void)
+{
+   int i;
+   if (--edit_depth > 0)
+      return;
+   for (i = 0; i < edit_count; i++)
+   {
+      EditList *list = edits + i;
+      edit_apply(list);
+      client_blocks(list->p, list->q, list->data, list->size);
+      free(list->data);
+      map_free(&list->pending);
+   }
+   if (edit_count)
+      db_commit();
+   edit_count = 0;
+   edit_last = 0;
+}
+
 static void builder_block(int x, int y, int z, int w)
 {
    if (y <= 0 || y >= MAX_BLOCK_HEIGHT)
       return;
+   if (edit_depth)
+   {
+      EditList *list = edit_list(chunked(x), chunked(z));
+      // replacing sends the removal first, as the server expects
+      if (is_destructable(edit_get_block(list, x, y, z)))
+         edit_block(list, x, y, z, 0);
+      if (w)
+         edit_block(list, x, y, z, w);
+      return;
+   }
    if (is_destructable(get_block(x, y, z)))
       set_block(x, y, z, 0);
    if (w)
@@ -1999,6 +2363,7 @@ static int render_chunks(Attrib *attrib, Player *player)
    float planes[6][4];
    struct shader_program_info info = {0};
    int result                      = 0;
+   uintptr_t bound                 = 0;
    State *s                        = &player->state;
    ensure_chunks(player);
 
@@ -2043,13 +2408,23 @@ static int render_chunks(Attrib *attrib, Player *player)
          if (chunk_distance(chunk, p, q) > RENDER_CHUNK_RADIUS)
             continue;
 
+         if (chunk->cloud_faces && chunk_visible(
+                  planes, chunk->p, chunk->q, CLOUD_LO, CLOUD_HI))
+         {
+            draw_slot_3d_ao(attrib, &chunk->cloud_buffer,
+                  chunk->cloud_faces * 6, &bound);
+            result += chunk->cloud_faces;
+         }
+
          if (!chunk_visible(
                   planes, chunk->p, chunk->q, chunk->miny, chunk->maxy))
             continue;
 
-         draw_triangles_3d_ao(attrib, chunk->buffer, chunk->faces * 6);
+         draw_slot_3d_ao(attrib, &chunk->buffer, chunk->faces * 6, &bound);
          result += chunk->faces;
       }
+      if (bound)
+         renderer_unbind_array_buffer(attrib, 1, 1);
    }
    return result;
 }
@@ -2450,6 +2825,7 @@ static void paste(void)
    int dx    = ABS(c2->x - c1->x);
    int dz    = ABS(c2->z - c1->z);
 
+   edit_begin();
    for (y = 0; y < MAX_BLOCK_HEIGHT; y++)
    {
       for (x = 0; x <= dx; x++)
@@ -2461,6 +2837,7 @@ static void paste(void)
          }
       }
    }
+   edit_end();
 }
 
 static void array(Block *b1, Block *b2, int xc, int yc, int zc)
@@ -2478,6 +2855,7 @@ static void array(Block *b1, Block *b2, int xc, int yc, int zc)
    yc = dy ? yc : 1;
    zc = dz ? zc : 1;
 
+   edit_begin();
    for (i = 0; i < xc; i++)
    {
       int x = b1->x + dx * i;
@@ -2491,6 +2869,7 @@ static void array(Block *b1, Block *b2, int xc, int yc, int zc)
          }
       }
    }
+   edit_end();
 }
 
 static void cube(Block *b1, Block *b2, int fill)
@@ -2510,6 +2889,7 @@ static void cube(Block *b1, Block *b2, int fill)
    z2 = MAX(b1->z, b2->z);
    a = (x1 == x2) + (y1 == y2) + (z1 == z2);
 
+   edit_begin();
    for (x = x1; x <= x2; x++)
    {
       for (y = y1; y <= y2; y++)
@@ -2529,6 +2909,7 @@ static void cube(Block *b1, Block *b2, int fill)
          }
       }
    }
+   edit_end();
 }
 
 static void sphere(Block *center, int radius, int fill, int fx, int fy, int fz)
@@ -2549,6 +2930,7 @@ static void sphere(Block *center, int radius, int fill, int fx, int fy, int fz)
     int cz = center->z;
     int w = center->w;
 
+    edit_begin();
     for (x = cx - radius; x <= cx + radius; x++)
     {
        int y;
@@ -2586,6 +2968,7 @@ static void sphere(Block *center, int radius, int fill, int fx, int fy, int fz)
             }
         }
     }
+    edit_end();
 }
 
 static void cylinder(Block *b1, Block *b2, int radius, int fill)
@@ -2605,6 +2988,7 @@ static void cylinder(Block *b1, Block *b2, int radius, int fill)
        int fz = z1 != z2;
        if (fx + fy + fz != 1)
           return;
+       edit_begin();
        {
           Block block = {x1, y1, z1, w};
           if (fx)
@@ -2635,6 +3019,7 @@ static void cylinder(Block *b1, Block *b2, int radius, int fill)
              }
           }
        }
+       edit_end();
     }
 }
 
@@ -2645,6 +3030,7 @@ static void tree(Block *block)
    int by = block->y;
    int bz = block->z;
 
+   edit_begin();
    for (y = by + 3; y < by + 8; y++)
    {
       for (dx = -3; dx <= 3; dx++)
@@ -2661,6 +3047,76 @@ static void tree(Block *block)
 
    for (y = by; y < by + 7; y++)
       builder_block(bx, y, bz, 5);
+   edit_end();
+}
+
+// server data applied in the last frame, and since connecting
+static unsigned net_applied = 0;
+static unsigned net_deferred = 0;
+static double net_apply_time = 0;
+static unsigned net_total_applied = 0;
+static unsigned net_total_deferred = 0;
+static double net_total_time = 0;
+static double net_max_apply_time = 0;
+
+static void write_counters(FILE *file, const ClientCounter *counters)
+{
+   int i, first = 1;
+   fprintf(file, "{");
+   for (i = 0; i < CLIENT_TYPES; i++) {
+      if (!counters[i].count || i <= ' ' || i == '"' || i == '\\' || i > '~')
+         continue;
+      fprintf(file, "%s\n    \"%c\": {\"count\": %u, \"bytes\": %u}",
+            first ? "" : ",", i, counters[i].count, counters[i].bytes);
+      first = 0;
+   }
+   fprintf(file, "\n  }");
+}
+
+// Writes the network counters as JSON, for /netstats.
+static int write_netstats(const char *path)
+{
+   ClientStats stats;
+   static ClientCounter in[CLIENT_TYPES];
+   static ClientCounter out[CLIENT_TYPES];
+   FILE *file = fopen(path, "w");
+   if (!file)
+      return 0;
+   client_get_stats(&stats);
+   client_get_counters(in, out);
+   fprintf(file, "{\n");
+   fprintf(file,
+         "  \"queue\": {\"capacity\": %u, \"fill\": %u, \"max_fill\": %u, "
+         "\"pending\": %u, \"stalls\": %u, \"stall_ms\": %.3f},\n",
+         stats.capacity, stats.fill, stats.max_fill, stats.pending,
+         stats.stalls, stats.stall_time * 1000);
+   fprintf(file,
+         "  \"bytes\": {\"received\": %d, \"sent\": %d},\n",
+         stats.bytes_received, stats.bytes_sent);
+   fprintf(file,
+         "  \"send\": {\"messages\": %u, \"writes\": %u, "
+         "\"batches\": %u, \"positions\": %u},\n",
+         stats.send_messages, stats.send_calls, stats.send_batches,
+         stats.positions_sent);
+   fprintf(file,
+         "  \"rtt_ms\": {\"last\": %.3f, \"average\": %.3f, "
+         "\"max\": %.3f, \"pings\": %u},\n",
+         stats.rtt * 1000, stats.average_rtt * 1000, stats.max_rtt * 1000,
+         stats.pings);
+   fprintf(file,
+         "  \"apply\": {\"messages\": %u, \"deferred\": %u, "
+         "\"total_ms\": %.3f, \"max_frame_ms\": %.3f, "
+         "\"us_per_message\": %.3f},\n",
+         net_total_applied, net_total_deferred, net_total_time * 1000,
+         net_max_apply_time * 1000,
+         net_total_applied ? net_total_time * 1e6 / net_total_applied : 0.0);
+   fprintf(file, "  \"in\": ");
+   write_counters(file, in);
+   fprintf(file, ",\n  \"out\": ");
+   write_counters(file, out);
+   fprintf(file, "\n}\n");
+   fclose(file);
+   return 1;
 }
 
 static void main_set_db_path(void)
@@ -2736,6 +3192,21 @@ static void parse_command(const char *buffer, int forward)
             add_message("Viewing distance must be between 1 and 24.");
         }
     }
+    else if (strcmp(buffer, "/netstats") == 0 ||
+          sscanf(buffer, "/netstats %255s", filename) == 1) {
+        char message[MAX_TEXT_LENGTH];
+        if (strcmp(buffer, "/netstats") == 0)
+            strcpy(filename, "netstats.json");
+        if (!get_client_enabled())
+            add_message("Network stats are only kept online.");
+        else if (write_netstats(filename)) {
+            snprintf(message, sizeof(message),
+                  "Wrote network stats to %s.", filename);
+            add_message(message);
+        }
+        else
+            add_message("Could not write the network stats.");
+    }
     else if (strcmp(buffer, "/copy") == 0)
     {
        memcpy(&g->copy0, &g->block0, sizeof(Block));
@@ -3153,104 +3624,198 @@ void handle_movement(double dt)
    }
 }
 
-static void parse_buffer(char *buffer)
+static void on_you(int pid, float x, float y, float z, float rx, float ry)
 {
    Model *g = (Model*)&model;
-    Player *me = g->players;
-    State *s = &g->players->state;
-    char *key;
-    char *line = tokenize(buffer, "\n", &key);
-    while (line)
-    {
-        int pid;
-        float ux, uy, uz, urx, ury;
-        float px, py, pz, prx, pry;
-        int bp, bq, bx, by, bz, bw;
-        int face;
-        char text[MAX_SIGN_LENGTH] = {0};
-        char name[MAX_NAME_LENGTH];
-        int kp, kq, kk;
-        double elapsed;
-        int day_length;
-        char format[64];
-
-        if (sscanf(line, "U,%d,%f,%f,%f,%f,%f",
-            &pid, &ux, &uy, &uz, &urx, &ury) == 6)
-        {
-            me->id = pid;
-            s->x = ux; s->y = uy; s->z = uz; s->rx = urx; s->ry = ury;
-            force_chunks(me);
-            if (uy == 0)
-                s->y = highest_block(s->x, s->z) + 2;
-        }
-        if (sscanf(line, "B,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-        {
-            _set_block(bp, bq, bx, by, bz, bw, 0);
-            if (player_intersects_block(2, s->x, s->y, s->z, bx, by, bz))
-                s->y = highest_block(s->x, s->z) + 2;
-        }
-        if (sscanf(line, "L,%d,%d,%d,%d,%d,%d",
-            &bp, &bq, &bx, &by, &bz, &bw) == 6)
-            set_light(bp, bq, bx, by, bz, bw);
-
-        if (sscanf(line, "P,%d,%f,%f,%f,%f,%f",
-            &pid, &px, &py, &pz, &prx, &pry) == 6)
-        {
-            Player *player = find_player(pid);
-            if (!player && g->player_count < MAX_PLAYERS) {
-                player = g->players + g->player_count;
-                g->player_count++;
-                player->id = pid;
-                player->buffer = 0;
-                snprintf(player->name, MAX_NAME_LENGTH, "player%d", pid);
-                update_player(player, px, py, pz, prx, pry, 1); // twice
-            }
-            if (player)
-                update_player(player, px, py, pz, prx, pry, 1);
-        }
-        if (sscanf(line, "D,%d", &pid) == 1)
-            delete_player(pid);
-
-
-        if (sscanf(line, "K,%d,%d,%d", &kp, &kq, &kk) == 3)
-            db_set_key(kp, kq, kk);
+   Player *me = g->players;
+   State *s = &me->state;
+   me->id = pid;
+   s->x = x; s->y = y; s->z = z; s->rx = rx; s->ry = ry;
+   force_chunks(me);
+   if (y == 0)
+      s->y = highest_block(s->x, s->z) + 2;
+}
 
-        if (sscanf(line, "R,%d,%d", &kp, &kq) == 2)
-        {
-            Chunk *chunk = find_chunk(kp, kq);
-            if (chunk)
-                dirty_chunk(chunk);
-        }
+static void on_block(int p, int q, int x, int y, int z, int w)
+{
+   Model *g = (Model*)&model;
+   State *s = &g->players->state;
+   _set_block(p, q, x, y, z, w, 0);
+   if (player_intersects_block(2, s->x, s->y, s->z, x, y, z))
+      s->y = highest_block(s->x, s->z) + 2;
+}
 
+// velocity is NULL for servers that only send positions
+static void on_position(int pid, float x, float y, float z, float rx, float ry,
+      const float *velocity)
+{
+   Model *g = (Model*)&model;
+   Player *player = find_player(pid);
+   if (!player && g->player_count < MAX_PLAYERS) {
+      player = g->players + g->player_count;
+      g->player_count++;
+      player->id = pid;
+      player->buffer = 0;
+      player->reckoned = 0;
+      snprintf(player->name, MAX_NAME_LENGTH, "player%d", pid);
+      update_player(player, x, y, z, rx, ry, 1); // twice
+      if (velocity)
+         update_player(player, x, y, z, rx, ry, 0);
+   }
+   if (player && velocity)
+      reckon_player(player, x, y, z, rx, ry,
+            velocity[0], velocity[1], velocity[2]);
+   else if (player)
+      update_player(player, x, y, z, rx, ry, 1);
+}
 
-        if (sscanf(line, "E,%lf,%d", &elapsed, &day_length) == 2)
-        {
-            glfwSetTime(fmod(elapsed, day_length));
-            g->day_length = day_length;
-            g->time_changed = 1;
-        }
-        if (line[0] == 'T' && line[1] == ',') {
-            char *text = line + 2;
-            add_message(text);
-        }
-        snprintf(
-            format, sizeof(format), "N,%%d,%%%ds", MAX_NAME_LENGTH - 1);
+static void on_redraw(int p, int q)
+{
+   Chunk *chunk = find_chunk(p, q);
+   if (chunk)
+      dirty_chunk(chunk);
+}
 
-        if (sscanf(line, format, &pid, name) == 2)
-        {
-            Player *player = find_player(pid);
+static void parse_line(char *line)
+{
+   Model *g = (Model*)&model;
+   Message m;
+   int *v = m.ints;
+   float *f = m.floats;
+   if (!protocol_parse_line(line, &m))
+      return;
+   switch (m.type)
+   {
+      case 'U':
+         on_you(v[0], f[0], f[1], f[2], f[3], f[4]);
+         break;
+      case 'B':
+         on_block(v[0], v[1], v[2], v[3], v[4], v[5]);
+         break;
+      case 'L':
+         set_light(v[0], v[1], v[2], v[3], v[4], v[5]);
+         break;
+      case 'P':
+         on_position(v[0], f[0], f[1], f[2], f[3], f[4], NULL);
+         break;
+      case 'D':
+         delete_player(v[0]);
+         break;
+      case 'K':
+         db_set_key(v[0], v[1], v[2]);
+         break;
+      case 'R':
+         on_redraw(v[0], v[1]);
+         break;
+      case 'E':
+         glfwSetTime(fmod(m.elapsed, v[0]));
+         g->day_length = v[0];
+         g->time_changed = 1;
+         break;
+      case 'T':
+         add_message(m.text);
+         break;
+      case 'N':
+         {
+            Player *player = find_player(v[0]);
             if (player)
-                strncpy(player->name, name, MAX_NAME_LENGTH);
-        }
-        snprintf(
-            format, sizeof(format),
-            "S,%%d,%%d,%%d,%%d,%%d,%%d,%%%d[^\n]", MAX_SIGN_LENGTH - 1);
-        if (sscanf(line, format,
-            &bp, &bq, &bx, &by, &bz, &face, text) >= 6)
-            _set_sign(bp, bq, bx, by, bz, face, text, 0);
-        line = tokenize(NULL, "\n", &key);
-    }
+               snprintf(player->name, MAX_NAME_LENGTH, "%s", m.text);
+         }
+         break;
+      case 'S':
+         {
+            char text[MAX_SIGN_LENGTH];
+            snprintf(text, MAX_SIGN_LENGTH, "%s", m.text);
+            _set_sign(v[0], v[1], v[2], v[3], v[4], v[5], text, 0);
+         }
+         break;
+      default:
+         break;
+   }
+}
+
+// binary protocol, see client.h for the frame layouts
+static void parse_frame(char type, char *data, int size)
+{
+   switch (type)
+   {
+      case 'B':
+      case 'L':
+         {
+            int p = client_read_int(data);
+            int q = client_read_int(data + 4);
+            int i;
+            for (i = 8; i + FRAME_BLOCK <= size; i += FRAME_BLOCK)
+            {
+               int x = p * CHUNK_SIZE + client_read_short(data + i);
+               int y = client_read_short(data + i + 2);
+               int z = q * CHUNK_SIZE + client_read_short(data + i + 4);
+               int w = client_read_short(data + i + 6);
+               if (type == 'B')
+                  on_block(p, q, x, y, z, w);
+               else
+                  set_light(p, q, x, y, z, w);
+            }
+         }
+         break;
+      case 'U':
+      case 'P':
+         if (size >= 24)
+         {
+            int pid = client_read_int(data);
+            float x = client_read_float(data + 4);
+            float y = client_read_float(data + 8);
+            float z = client_read_float(data + 12);
+            float rx = client_read_float(data + 16);
+            float ry = client_read_float(data + 20);
+            float velocity[3];
+            if (type == 'U')
+               on_you(pid, x, y, z, rx, ry);
+            else if (size >= 36)
+            {
+               velocity[0] = client_read_float(data + 24);
+               velocity[1] = client_read_float(data + 28);
+               velocity[2] = client_read_float(data + 32);
+               on_position(pid, x, y, z, rx, ry, velocity);
+            }
+            else
+               on_position(pid, x, y, z, rx, ry, NULL);
+         }
+         break;
+      case 'D':
+         if (size >= 4)
+            delete_player(client_read_int(data));
+         break;
+      case 'K':
+         if (size >= 12)
+            db_set_key(
+                  client_read_int(data),
+                  client_read_int(data + 4),
+                  client_read_int(data + 8));
+         if (size >= 20)
+            db_set_versions(
+                  client_read_int(data),
+                  client_read_int(data + 4),
+                  client_read_int(data + 12),
+                  client_read_int(data + 16));
+         break;
+      case 'R':
+         if (size >= 8)
+            on_redraw(client_read_int(data), client_read_int(data + 4));
+         break;
+      case FRAME_TEXT:
+         {
+            // frames are not terminated, copy the line out
+            char line[4096];
+            size = MIN(size, (int)sizeof(line) - 1);
+            memcpy(line, data, size);
+            line[size] = '\0';
+            parse_line(line);
+         }
+         break;
+      default:
+         break;
+   }
 }
 
 void reset_model(void)
@@ -3276,6 +3841,44 @@ void reset_model(void)
 
 static craft_info_t info;
 
+// Applies queued server messages until the queue is empty or the per
+// frame budget is spent, in milliseconds (NET_TIME_BUDGET) or messages
+// (NET_MESSAGE_BUDGET), zero meaning no limit. Whatever is left stays
+// in the receive queue for the next frame. At least one message is
+// applied per frame so a slow one cannot stall the queue.
+static void apply_server_data(void)
+{
+   ClientMessage message;
+   double start = perf_now();
+   double limit = NET_TIME_BUDGET / 1000.0;
+   int over_budget = 0;
+   net_applied = 0;
+   net_deferred = 0;
+   while (client_next(&message)) {
+      if (message.binary)
+         parse_frame(message.type, message.data, message.length);
+      else
+         parse_line(message.data);
+      net_applied++;
+      if (NET_MESSAGE_BUDGET && net_applied >= NET_MESSAGE_BUDGET) {
+         over_budget = 1;
+         break;
+      }
+      if (NET_TIME_BUDGET && perf_now() - start >= limit) {
+         over_budget = 1;
+         break;
+      }
+   }
+   net_apply_time = perf_now() - start;
+   if (over_budget)
+      net_deferred = client_pending();
+   net_total_applied += net_applied;
+   net_total_deferred += net_deferred;
+   net_total_time += net_apply_time;
+   if (net_apply_time > net_max_apply_time)
+      net_max_apply_time = net_apply_time;
+}
+
 int main_init(void)
 {
    // INITIALIZATION //
@@ -3348,6 +3951,7 @@ int main_load_game(int argc, char **argv)
    g->sign_radius   = RENDER_SIGN_RADIUS;
 
    // INITIALIZE WORKER THREADS
+   world_cache_init();
    for (i = 0; i < WORKERS; i++) {
       Worker *worker = g->workers + i;
       worker->index = i;
@@ -3361,8 +3965,32 @@ int main_load_game(int argc, char **argv)
    if (g->mode == MODE_OFFLINE || USE_CACHE)
    {
       db_enable();
+      db_set_backend(DB_BACKEND);
+      if (DB_DURABILITY == DB_DURABILITY_MEMORY && g->mode == MODE_OFFLINE)
+         // only a cache can live in memory, a world has to be kept
+         db_set_durability(DB_DURABILITY_NORMAL);
+      else if (DB_DURABILITY != DB_DURABILITY_AUTO)
+         db_set_durability(DB_DURABILITY);
+      else if (g->mode == MODE_ONLINE)
+         // the online cache can always be fetched again
+         db_set_durability(DB_DURABILITY_OFF);
+      else
+         db_set_durability(DB_DURABILITY_NORMAL);
       if (db_init(g->db_path))
          return -1;
+      if (g->mode == MODE_OFFLINE) {
+         // world generation options are fixed when a world is created,
+         // so existing worlds keep generating the same terrain
+         float x, y, z, rx, ry;
+         int existing = db_load_state(&x, &y, &z, &rx, &ry);
+         int terrain = db_get_option(
+               "terrain", existing ? TERRAIN_EXACT : WORLD_TERRAIN);
+         int trees = db_get_option("trees", !existing);
+         db_set_option("terrain", terrain);
+         db_set_option("trees", trees);
+         world_set_terrain(terrain);
+         world_set_structures(trees);
+      }
       if (g->mode == MODE_ONLINE) {
          // TODO: support proper caching of signs (handle deletions)
          db_delete_all_signs();
@@ -3374,7 +4002,11 @@ int main_load_game(int argc, char **argv)
       client_enable();
       client_connect(g->server_addr, g->server_port);
       client_start();
-      client_version(1);
+      net_total_applied = 0;
+      net_total_deferred = 0;
+      net_total_time = 0;
+      net_max_apply_time = 0;
+      client_version(PROTOCOL_BINARY);
       login();
    }
 
@@ -3385,6 +4017,7 @@ int main_load_game(int argc, char **argv)
    info.fps.since   = 0;
    info.last_commit = glfwGetTime();
    info.last_update = glfwGetTime();
+   info.last_ping = glfwGetTime();
    info.sky_buffer = gen_sky_buffer();
 
    info.me = g->players;
@@ -3425,6 +4058,7 @@ void main_deinit(void)
    client_disable();
    renderer_del_buffer(info.sky_buffer);
    delete_all_chunks();
+   renderer_free_arenas();
    delete_all_players();
 }
 
@@ -3432,7 +4066,6 @@ int main_run(void)
 {
    int i;
    double now, dt;
-   char *buffer;
    char text_buffer[1024];
    float ts, tx, ty;
    int face_count;
@@ -3449,6 +4082,7 @@ int main_run(void)
       g->time_changed = 0;
       info.last_commit = glfwGetTime();
       info.last_update = glfwGetTime();
+      info.last_ping = glfwGetTime();
       memset(&info.fps, 0, sizeof(info.fps));
    }
    update_fps(&info.fps);
@@ -3465,11 +4099,7 @@ int main_run(void)
    handle_movement(dt);
 
    // HANDLE DATA FROM SERVER //
-   buffer = client_recv();
-   if (buffer) {
-      parse_buffer(buffer);
-      free(buffer);
-   }
+   apply_server_data();
 
    // FLUSH DATABASE //
    if (now - info.last_commit > COMMIT_INTERVAL) {
@@ -3482,6 +4112,10 @@ int main_run(void)
       info.last_update = now;
       client_position(info.s->x, info.s->y, info.s->z, info.s->rx, info.s->ry);
    }
+   if (now - info.last_ping > PING_INTERVAL) {
+      info.last_ping = now;
+      client_ping();
+   }
 
    // PREPARE TO RENDER //
 
@@ -3541,6 +4175,76 @@ int main_run(void)
             face_count * 2, hour, am_pm, info.fps.fps);
       render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
       ty -= ts * 2;
+      {
+         WorldCacheStats cache_stats;
+         unsigned int lookups;
+         world_cache_stats(&cache_stats);
+         lookups = cache_stats.hits + cache_stats.misses;
+         snprintf(
+               text_buffer, 1024, "noise cache %d%% hits (%u/%u)",
+               lookups ? (int)(100.0 * cache_stats.hits / lookups) : 0,
+               cache_stats.hits, lookups);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+      }
+      {
+         RendererArenaStats arena_stats;
+         renderer_get_arena_stats(&arena_stats);
+         snprintf(
+               text_buffer, 1024,
+               "gpu %d arenas %uMB of %uMB %u holes in place %u/%u",
+               arena_stats.arenas, arena_stats.used >> 20,
+               arena_stats.reserved >> 20, arena_stats.free_ranges,
+               arena_stats.in_place, arena_stats.uploads);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+      }
+      if (get_db_enabled()) {
+         DbStats db_stats;
+         db_get_stats(&db_stats);
+         snprintf(
+               text_buffer, 1024, "db %s/%s commit %.1fms max %.1fms",
+               db_stats.backend, db_stats.durability,
+               db_stats.last_commit_time * 1000,
+               db_stats.max_commit_time * 1000);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+      }
+      if (get_client_enabled()) {
+         ClientStats client_stats;
+         client_get_stats(&client_stats);
+         snprintf(
+               text_buffer, 1024,
+               "net queue %d%% max %d%% stalls %u (%.1fms)",
+               (int)(100.0 * client_stats.fill / client_stats.capacity),
+               (int)(100.0 * client_stats.max_fill / client_stats.capacity),
+               client_stats.stalls, client_stats.stall_time * 1000);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+         snprintf(
+               text_buffer, 1024,
+               "net applied %u in %.1fms deferred %u queued %u",
+               net_applied, net_apply_time * 1000, net_deferred,
+               client_stats.pending);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+         snprintf(
+               text_buffer, 1024,
+               "net sent %dKB %u messages in %u writes (%u batches)",
+               client_stats.bytes_sent / 1024, client_stats.send_messages,
+               client_stats.send_calls, client_stats.send_batches);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+         snprintf(
+               text_buffer, 1024,
+               "net rtt %.1fms avg %.1fms max %.1fms parse %.2fus/msg",
+               client_stats.rtt * 1000, client_stats.average_rtt * 1000,
+               client_stats.max_rtt * 1000,
+               net_total_applied ?
+               net_total_time * 1e6 / net_total_applied : 0.0);
+         render_text(&info.text_attrib, ALIGN_LEFT, tx, ty, ts, text_buffer);
+         ty -= ts * 2;
+      }
    }
    if (SHOW_CHAT_TEXT) {
       int i;
@@ -3610,6 +4314,9 @@ int main_run(void)
       }
    }
 
+   // SEND THIS FRAME'S MESSAGES TO SERVER //
+   client_flush();
+
    if (g->mode_changed)
    {
       g->mode_changed = 0;
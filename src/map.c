@@ -80,6 +80,43 @@ int map_set(Map *map, int x, int y, int z, int w)
    return 0;
 }
 
+void map_fill(Map *map, int x, int z, int y0, int y1, int w) {
+    int y;
+    int hxz;
+    if (!w) {
+        for (y = y0; y < y1; y++) {
+            map_set(map, x, y, z, 0);
+        }
+        return;
+    }
+    // grow once up front instead of during the run
+    while ((map->size + (y1 - y0)) * 2 > map->mask) {
+        map_grow(map);
+    }
+    hxz = hash_int(x) ^ hash_int(z);
+    x -= map->dx;
+    z -= map->dz;
+    for (y = y0; y < y1; y++) {
+        unsigned int index = (hxz ^ hash_int(y)) & map->mask;
+        MapEntry *entry = map->data + index;
+        int ey = y - map->dy;
+        while (!EMPTY_ENTRY(entry)) {
+            if (entry->e.x == x && entry->e.y == ey && entry->e.z == z) {
+                break;
+            }
+            index = (index + 1) & map->mask;
+            entry = map->data + index;
+        }
+        if (EMPTY_ENTRY(entry)) {
+            entry->e.x = x;
+            entry->e.y = ey;
+            entry->e.z = z;
+            map->size++;
+        }
+        entry->e.w = w;
+    }
+}
+
 int map_get(Map *map, int x, int y, int z) {
     unsigned int index = hash(x, y, z) & map->mask;
     MapEntry *entry;
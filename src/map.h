@@ -44,6 +44,7 @@ void map_free(Map *map);
 void map_copy(Map *dst, Map *src);
 void map_grow(Map *map);
 int map_set(Map *map, int x, int y, int z, int w);
+void map_fill(Map *map, int x, int z, int y0, int y1, int w);
 int map_get(Map *map, int x, int y, int z);
 
 #endif
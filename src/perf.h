@@ -0,0 +1,6 @@
+#ifndef _perf_h_
+#define _perf_h_
+
+double perf_now(void);
+
+#endif
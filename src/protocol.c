@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+static char *parse_int(char *p, int *value)
+{
+   int sign = 1;
+   int result = 0;
+   if (*p == '-' || *p == '+')
+      sign = *p++ == '-' ? -1 : 1;
+   if (!IS_DIGIT(*p))
+      return 0;
+   while (IS_DIGIT(*p))
+      result = result * 10 + (*p++ - '0');
+   *value = sign * result;
+   return p;
+}
+
+// the server formats floats with str(), so exponents do show up
+static char *parse_float(char *p, float *value)
+{
+   double sign = 1;
+   double result = 0;
+   int digits = 0;
+   if (*p == '-' || *p == '+')
+      sign = *p++ == '-' ? -1 : 1;
+   while (IS_DIGIT(*p))
+   {
+      result = result * 10 + (*p++ - '0');
+      digits++;
+   }
+   if (*p == '.')
+   {
+      double scale = 0.1;
+      p++;
+      while (IS_DIGIT(*p))
+      {
+         result += (*p++ - '0') * scale;
+         scale *= 0.1;
+         digits++;
+      }
+   }
+   if (!digits)
+      return 0;
+   if (*p == 'e' || *p == 'E')
+   {
+      int exponent;
+      char *end = parse_int(p + 1, &exponent);
+      if (end)
+      {
+         p = end;
+         for (; exponent > 0; exponent--)
+            result *= 10;
+         for (; exponent < 0; exponent++)
+            result /= 10;
+      }
+   }
+   *value = sign * result;
+   return p;
+}
+
+// count comma separated integers starting at p
+static char *parse_ints(char *p, int *values, int count)
+{
+   int i;
+   for (i = 0; i < count && p; i++)
+   {
+      if (i && *p++ != ',')
+         return 0;
+      p = parse_int(p, values + i);
+   }
+   return p;
+}
+
+static char *parse_floats(char *p, float *values, int count)
+{
+   int i;
+   for (i = 0; i < count && p; i++)
+   {
+      if (*p++ != ',')
+         return 0;
+      p = parse_float(p, values + i);
+   }
+   return p;
+}
+
+int protocol_parse_line(char *line, Message *message)
+{
+   char *p = line + 2;
+   if (!line[0] || line[1] != ',')
+      return 0;
+   message->type = line[0];
+   switch (line[0])
+   {
+      case 'B':
+      case 'L':
+         return parse_ints(p, message->ints, 6) != 0;
+      case 'U':
+      case 'P':
+         p = parse_ints(p, message->ints, 1);
+         return p && parse_floats(p, message->floats, 5);
+      case 'D':
+         return parse_ints(p, message->ints, 1) != 0;
+      case 'K':
+         return parse_ints(p, message->ints, 3) != 0;
+      case 'R':
+         return parse_ints(p, message->ints, 2) != 0;
+      case 'E':
+         {
+            char *end;
+            message->elapsed = strtod(p, &end);
+            if (end == p || *end != ',')
+               return 0;
+            return parse_int(end + 1, message->ints) != 0;
+         }
+      case 'T':
+         message->text = p;
+         return 1;
+      case 'N':
+         p = parse_ints(p, message->ints, 1);
+         if (!p || *p++ != ',')
+            return 0;
+         while (IS_SPACE(*p))
+            p++;
+         if (!*p)
+            return 0;
+         message->text = p;
+         while (*p && !IS_SPACE(*p))
+            p++;
+         *p = '\0';
+         return 1;
+      case 'S':
+         p = parse_ints(p, message->ints, 6);
+         if (!p)
+            return 0;
+         message->text = *p == ',' ? p + 1 : p + strlen(p);
+         return 1;
+      default:
+         break;
+   }
+   return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _protocol_h_
+#define _protocol_h_
+
+/* One line of the text protocol, parsed in place. The fields set depend
+   on the type:
+
+   U, P: ints[0] id, floats x, y, z, rx, ry
+   B, L: ints p, q, x, y, z, w
+   D: ints[0] id
+   K: ints p, q, key
+   R: ints p, q
+   E: elapsed, ints[0] day length
+   T: text
+   N: ints[0] id, text is the name
+   S: ints p, q, x, y, z, face, text (possibly empty)
+
+   text points into the line, which is modified. */
+typedef struct {
+    char type;
+    int ints[6];
+    float floats[5];
+    double elapsed;
+    char *text;
+} Message;
+
+int protocol_parse_line(char *line, Message *message);
+
+#endif
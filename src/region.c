@@ -0,0 +1,481 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "config.h"
+#include "storage.h"
+#include "tinycthread.h"
+
+/* Region files hold a REGION_SIZE x REGION_SIZE grid of chunks. The file
+   starts with an offset table, one entry per chunk, followed by sectors.
+   Each chunk owns a contiguous run of sectors holding a log of fixed size
+   records; later records override earlier ones when the log is replayed
+   into a Map. Records are only ever appended. When a run is full it is
+   copied to a run twice as large at the end of the file. */
+
+#define REGION_SIZE 32
+#define REGION_CHUNKS (REGION_SIZE * REGION_SIZE)
+#define REGION_MAGIC "CRAFTRGN"
+#define REGION_VERSION 2
+#define SECTOR_SIZE 4096
+#define GROW_SECTORS 64
+#define MAX_REGIONS 16
+#define MAX_REGION_PATH 1024
+
+#define RECORD_BLOCK 1
+#define RECORD_LIGHT 2
+
+#define FLAG_GENERATED 1
+
+typedef struct {
+    uint32_t offset;
+    uint32_t sectors;
+    uint32_t used;
+    int32_t key;
+    uint32_t flags;
+} RegionEntry;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t sectors;
+    RegionEntry entries[REGION_CHUNKS];
+} RegionHeader;
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+    int16_t w;
+    uint8_t type;
+    uint8_t unused;
+} RegionRecord;
+
+#define HEADER_SECTORS \
+    ((sizeof(RegionHeader) + SECTOR_SIZE - 1) / SECTOR_SIZE)
+
+typedef struct {
+    int rp;
+    int rq;
+    int open;
+    int absent;
+    unsigned int last_use;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    size_t size;
+    char *data;
+} Region;
+
+static Region regions[MAX_REGIONS];
+static unsigned int use_counter;
+static char base_path[MAX_REGION_PATH - 32];
+static mtx_t mtx;
+
+static int floor_div(int a, int b) {
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+static RegionHeader *region_header(Region *region) {
+    return (RegionHeader *)region->data;
+}
+
+static void region_unmap(Region *region) {
+    if (!region->data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(region->data);
+    CloseHandle(region->mapping);
+    region->mapping = NULL;
+#else
+    munmap(region->data, region->size);
+#endif
+    region->data = NULL;
+}
+
+static int region_map(Region *region, size_t size) {
+#ifdef _WIN32
+    region->mapping = CreateFileMappingA(
+        region->file, NULL, PAGE_READWRITE,
+        (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (!region->mapping) {
+        return -1;
+    }
+    region->data = (char *)MapViewOfFile(
+        region->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!region->data) {
+        CloseHandle(region->mapping);
+        region->mapping = NULL;
+        return -1;
+    }
+#else
+    void *data;
+    if (ftruncate(region->fd, (off_t)size) == -1) {
+        return -1;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        region->fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    region->data = (char *)data;
+#endif
+    region->size = size;
+    return 0;
+}
+
+static int region_reserve(Region *region, size_t sectors) {
+    size_t size = sectors * SECTOR_SIZE;
+    if (size <= region->size) {
+        return 0;
+    }
+    sectors = (sectors + GROW_SECTORS - 1) / GROW_SECTORS * GROW_SECTORS;
+    region_unmap(region);
+    return region_map(region, sectors * SECTOR_SIZE);
+}
+
+static void region_sync(Region *region, int wait) {
+    if (!region->data) {
+        return;
+    }
+#ifdef _WIN32
+    FlushViewOfFile(region->data, 0);
+    if (wait) {
+        FlushFileBuffers(region->file);
+    }
+#else
+    msync(region->data, region->size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+static void region_close(Region *region) {
+    if (!region->open) {
+        return;
+    }
+    region_sync(region, 0);
+    region_unmap(region);
+#ifdef _WIN32
+    CloseHandle(region->file);
+#else
+    close(region->fd);
+#endif
+    region->open = 0;
+}
+
+static int region_open(Region *region, int rp, int rq, int create) {
+    char path[MAX_REGION_PATH];
+    size_t size;
+    RegionHeader *header;
+    snprintf(path, MAX_REGION_PATH, "%s.r.%d.%d", base_path, rp, rq);
+#ifdef _WIN32
+    {
+        LARGE_INTEGER length;
+        region->file = CreateFileA(
+            path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            create ? OPEN_ALWAYS : OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (region->file == INVALID_HANDLE_VALUE) {
+            return -1;
+        }
+        GetFileSizeEx(region->file, &length);
+        size = (size_t)length.QuadPart;
+    }
+#else
+    {
+        struct stat st;
+        region->fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+        if (region->fd == -1) {
+            return -1;
+        }
+        fstat(region->fd, &st);
+        size = (size_t)st.st_size;
+    }
+#endif
+    region->data = NULL;
+    region->size = 0;
+    region->rp = rp;
+    region->rq = rq;
+    region->open = 1;
+    region->absent = 0;
+    if (size < HEADER_SECTORS * SECTOR_SIZE) {
+        if (region_reserve(region, HEADER_SECTORS)) {
+            region_close(region);
+            return -1;
+        }
+        header = region_header(region);
+        memset(header, 0, sizeof(RegionHeader));
+        memcpy(header->magic, REGION_MAGIC, sizeof(header->magic));
+        header->version = REGION_VERSION;
+        header->sectors = HEADER_SECTORS;
+        return 0;
+    }
+    if (region_map(region, size)) {
+        region_close(region);
+        return -1;
+    }
+    header = region_header(region);
+    if (memcmp(header->magic, REGION_MAGIC, sizeof(header->magic)) ||
+        header->version != REGION_VERSION)
+    {
+        fprintf(stderr, "region: ignoring invalid file %s\n", path);
+        region_close(region);
+        return -1;
+    }
+    return 0;
+}
+
+/* Slots that are not open can remember a region without a file, so
+   loading the chunks of an ungenerated region does not try to open the
+   file again for each of them. The entry goes once the region is
+   created. */
+static Region *find_region(int p, int q, int create) {
+    int i;
+    int rp = floor_div(p, REGION_SIZE);
+    int rq = floor_div(q, REGION_SIZE);
+    Region opened;
+    Region *result = NULL;
+    Region *spare = NULL;
+    for (i = 0; i < MAX_REGIONS; i++) {
+        Region *region = regions + i;
+        int used = region->open || region->absent;
+        if (used && region->rp == rp && region->rq == rq) {
+            region->last_use = ++use_counter;
+            if (region->open) {
+                return region;
+            }
+            if (!create) {
+                return NULL;
+            }
+            region->absent = 0;
+            used = 0;
+        }
+        if (!result || !used ||
+            ((result->open || result->absent) &&
+            region->last_use < result->last_use))
+        {
+            result = region;
+        }
+        if (!region->open && (!spare || !used ||
+            (spare->absent && region->last_use < spare->last_use)))
+        {
+            spare = region;
+        }
+    }
+    if (region_open(&opened, rp, rq, create)) {
+        if (!create && spare) {
+            spare->rp = rp;
+            spare->rq = rq;
+            spare->absent = 1;
+            spare->last_use = ++use_counter;
+        }
+        return NULL;
+    }
+    region_close(result);
+    memcpy(result, &opened, sizeof(Region));
+    result->last_use = ++use_counter;
+    return result;
+}
+
+static RegionEntry *find_entry(Region *region, int p, int q) {
+    int dp = p - region->rp * REGION_SIZE;
+    int dq = q - region->rq * REGION_SIZE;
+    return region_header(region)->entries + dp * REGION_SIZE + dq;
+}
+
+static void append_record(int p, int q, int x, int y, int z, int w, int type) {
+    Region *region;
+    RegionEntry *entry;
+    RegionRecord record;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 1);
+    if (!region) {
+        mtx_unlock(&mtx);
+        return;
+    }
+    entry = find_entry(region, p, q);
+    if (!entry->offset ||
+        entry->used + sizeof(RegionRecord) > entry->sectors * SECTOR_SIZE)
+    {
+        uint32_t sectors = entry->sectors ? entry->sectors * 2 : 1;
+        uint32_t offset = region_header(region)->sectors;
+        if (entry->offset && entry->offset + entry->sectors == offset) {
+            // the run is last in the file, grow it in place
+            offset = entry->offset;
+        }
+        if (region_reserve(region, offset + sectors)) {
+            mtx_unlock(&mtx);
+            return;
+        }
+        entry = find_entry(region, p, q);
+        if (entry->used && entry->offset != offset) {
+            memcpy(
+                region->data + (size_t)offset * SECTOR_SIZE,
+                region->data + (size_t)entry->offset * SECTOR_SIZE,
+                entry->used);
+        }
+        entry->offset = offset;
+        entry->sectors = sectors;
+        region_header(region)->sectors = offset + sectors;
+    }
+    record.x = x;
+    record.y = y;
+    record.z = z;
+    record.w = w;
+    record.type = type;
+    record.unused = 0;
+    memcpy(
+        region->data + (size_t)entry->offset * SECTOR_SIZE + entry->used,
+        &record, sizeof(RegionRecord));
+    entry->used += sizeof(RegionRecord);
+    mtx_unlock(&mtx);
+}
+
+static void load_records(Map *map, int p, int q, int type) {
+    Region *region;
+    RegionEntry *entry;
+    const RegionRecord *records;
+    uint32_t i, count;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 0);
+    if (!region) {
+        mtx_unlock(&mtx);
+        return;
+    }
+    entry = find_entry(region, p, q);
+    if (entry->offset) {
+        records = (const RegionRecord *)(
+            region->data + (size_t)entry->offset * SECTOR_SIZE);
+        count = entry->used / sizeof(RegionRecord);
+        for (i = 0; i < count; i++) {
+            const RegionRecord *record = records + i;
+            if (record->type == type) {
+                map_set(map, record->x, record->y, record->z, record->w);
+            }
+        }
+    }
+    mtx_unlock(&mtx);
+}
+
+static int region_backend_open(const char *path) {
+    snprintf(base_path, sizeof(base_path), "%s", path);
+    memset(regions, 0, sizeof(regions));
+    use_counter = 0;
+    mtx_init(&mtx, mtx_plain);
+    return 0;
+}
+
+static void region_backend_close(void) {
+    int i;
+    mtx_lock(&mtx);
+    for (i = 0; i < MAX_REGIONS; i++) {
+        region_close(regions + i);
+    }
+    mtx_unlock(&mtx);
+    mtx_destroy(&mtx);
+}
+
+static void region_backend_commit(int sync) {
+    int i;
+    mtx_lock(&mtx);
+    for (i = 0; i < MAX_REGIONS; i++) {
+        if (regions[i].open) {
+            region_sync(regions + i, sync);
+        }
+    }
+    mtx_unlock(&mtx);
+}
+
+static void region_insert_block(int p, int q, int x, int y, int z, int w) {
+    append_record(p, q, x, y, z, w, RECORD_BLOCK);
+}
+
+static void region_insert_light(int p, int q, int x, int y, int z, int w) {
+    append_record(p, q, x, y, z, w, RECORD_LIGHT);
+}
+
+static void region_load_blocks(Map *map, int p, int q) {
+    load_records(map, p, q, RECORD_BLOCK);
+}
+
+static void region_load_lights(Map *map, int p, int q) {
+    load_records(map, p, q, RECORD_LIGHT);
+}
+
+static int region_get_key(int p, int q) {
+    int result = 0;
+    Region *region;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 0);
+    if (region) {
+        result = find_entry(region, p, q)->key;
+    }
+    mtx_unlock(&mtx);
+    return result;
+}
+
+static void region_set_key(int p, int q, int key) {
+    Region *region;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 1);
+    if (region) {
+        find_entry(region, p, q)->key = key;
+    }
+    mtx_unlock(&mtx);
+}
+
+static int region_get_generated(int p, int q) {
+    int result = 0;
+    Region *region;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 0);
+    if (region) {
+        result = (find_entry(region, p, q)->flags & FLAG_GENERATED) != 0;
+    }
+    mtx_unlock(&mtx);
+    return result;
+}
+
+static void region_set_generated(int p, int q) {
+    Region *region;
+    mtx_lock(&mtx);
+    region = find_region(p, q, 1);
+    if (region) {
+        find_entry(region, p, q)->flags |= FLAG_GENERATED;
+    }
+    mtx_unlock(&mtx);
+}
+
+const StorageBackend region_backend = {
+    "region",
+    region_backend_open,
+    region_backend_close,
+    region_backend_commit,
+    region_insert_block,
+    region_insert_light,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    region_load_blocks,
+    region_load_lights,
+    NULL,
+    region_get_key,
+    region_set_key,
+    region_get_generated,
+    region_set_generated
+};
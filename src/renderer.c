@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include <glsm/glsmsym.h>
 
@@ -577,6 +578,12 @@ void renderer_disable_polygon_offset_fill(void)
 }
 
 void renderer_draw_triangle_arrays(enum draw_prim_type type, unsigned count)
+{
+   renderer_draw_triangle_range(type, 0, count);
+}
+
+void renderer_draw_triangle_range(enum draw_prim_type type,
+      unsigned first, unsigned count)
 {
 #if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
    GLenum gl_prim_type;
@@ -590,7 +597,7 @@ void renderer_draw_triangle_arrays(enum draw_prim_type type, unsigned count)
          gl_prim_type = GL_LINES;
          break;
    }
-   glDrawArrays(gl_prim_type, 0, count);
+   glDrawArrays(gl_prim_type, first, count);
 #endif
 }
 
@@ -622,3 +629,234 @@ void renderer_upload_image(int width, int height, unsigned char *data)
          GL_UNSIGNED_BYTE, data);
 #endif
 }
+
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+/* Offsets and sizes in an arena are in vertices. Meshes are given whole
+   granules, so a chunk that gains a few faces from an edit is usually
+   rewritten where it already is. */
+#define ARENA_COMPONENTS 10
+#define ARENA_STRIDE (sizeof(GLfloat) * ARENA_COMPONENTS)
+#define ARENA_VERTICES (1 << 18)
+#define ARENA_GRANULE 256
+#define MAX_ARENAS 32
+
+typedef struct
+{
+   unsigned offset;
+   unsigned size;
+} ArenaRange;
+
+typedef struct
+{
+   GLuint buffer;
+   ArenaRange *ranges; /* free ranges, sorted by offset */
+   int count;
+   int capacity;
+   unsigned used;
+} Arena;
+
+static Arena arenas[MAX_ARENAS];
+static int arena_count;
+static unsigned int arena_uploads;
+static unsigned int arena_in_place;
+static unsigned int arena_dedicated;
+
+static void arena_create(Arena *arena)
+{
+   glGenBuffers(1, &arena->buffer);
+   glBindBuffer(GL_ARRAY_BUFFER, arena->buffer);
+   glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(ARENA_STRIDE * ARENA_VERTICES),
+         NULL, GL_DYNAMIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   arena->capacity = 16;
+   arena->ranges = malloc(sizeof(ArenaRange) * arena->capacity);
+   arena->ranges[0].offset = 0;
+   arena->ranges[0].size = ARENA_VERTICES;
+   arena->count = 1;
+   arena->used = 0;
+}
+
+// first fit, returns -1 when no free range is big enough
+static int arena_reserve(Arena *arena, unsigned size)
+{
+   int i;
+   for (i = 0; i < arena->count; i++)
+   {
+      ArenaRange *range = arena->ranges + i;
+      unsigned offset = range->offset;
+      if (range->size < size)
+         continue;
+      range->offset += size;
+      range->size -= size;
+      if (!range->size)
+      {
+         memmove(range, range + 1,
+               sizeof(ArenaRange) * (arena->count - i - 1));
+         arena->count--;
+      }
+      arena->used += size;
+      return offset;
+   }
+   return -1;
+}
+
+// gives a range back, merging it with the free ranges around it
+static void arena_release(Arena *arena, unsigned offset, unsigned size)
+{
+   ArenaRange *ranges = arena->ranges;
+   int i = 0;
+   while (i < arena->count && ranges[i].offset < offset)
+      i++;
+   arena->used -= size;
+   if (i > 0 && ranges[i - 1].offset + ranges[i - 1].size == offset)
+   {
+      ranges[i - 1].size += size;
+      if (i < arena->count && offset + size == ranges[i].offset)
+      {
+         ranges[i - 1].size += ranges[i].size;
+         memmove(ranges + i, ranges + i + 1,
+               sizeof(ArenaRange) * (arena->count - i - 1));
+         arena->count--;
+      }
+      return;
+   }
+   if (i < arena->count && offset + size == ranges[i].offset)
+   {
+      ranges[i].offset = offset;
+      ranges[i].size += size;
+      return;
+   }
+   if (arena->count == arena->capacity)
+   {
+      arena->capacity *= 2;
+      arena->ranges = realloc(
+            arena->ranges, sizeof(ArenaRange) * arena->capacity);
+      ranges = arena->ranges;
+   }
+   memmove(ranges + i + 1, ranges + i,
+         sizeof(ArenaRange) * (arena->count - i));
+   ranges[i].offset = offset;
+   ranges[i].size = size;
+   arena->count++;
+}
+
+static void arena_place(RendererSlot *slot, unsigned size, unsigned count)
+{
+   GLuint buffer;
+   int i;
+   if (size <= ARENA_VERTICES)
+   {
+      for (i = 0; i < MAX_ARENAS && i <= arena_count; i++)
+      {
+         int offset;
+         if (i == arena_count)
+            arena_create(arenas + arena_count++);
+         offset = arena_reserve(arenas + i, size);
+         if (offset < 0)
+            continue;
+         slot->buffer = arenas[i].buffer;
+         slot->first = offset;
+         slot->size = size;
+         slot->arena = i + 1;
+         return;
+      }
+   }
+   // too big for an arena, or every arena is full
+   glGenBuffers(1, &buffer);
+   glBindBuffer(GL_ARRAY_BUFFER, buffer);
+   glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(ARENA_STRIDE * count),
+         NULL, GL_DYNAMIC_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   slot->buffer = buffer;
+   slot->first = 0;
+   slot->size = count;
+   slot->arena = 0;
+   arena_dedicated++;
+}
+#endif
+
+/* Uploads faces of 10 floats a vertex into slot and frees data. The
+   mesh is rewritten in place when it still fits, otherwise it moves. */
+void renderer_upload_faces(RendererSlot *slot, int faces, float *data)
+{
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+   unsigned count = faces * 6;
+   unsigned size = (count + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+   if (!count)
+      renderer_free_slot(slot);
+   else if (slot->buffer && count <= slot->size)
+   {
+      arena_in_place++;
+      if (slot->arena && size < slot->size)
+      {
+         arena_release(arenas + slot->arena - 1,
+               slot->first + size, slot->size - size);
+         slot->size = size;
+      }
+   }
+   else
+   {
+      renderer_free_slot(slot);
+      arena_place(slot, size, count);
+   }
+   if (count)
+   {
+      glBindBuffer(GL_ARRAY_BUFFER, (GLuint)slot->buffer);
+      glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)(ARENA_STRIDE * slot->first),
+            (GLsizeiptr)(ARENA_STRIDE * count), data);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      arena_uploads++;
+   }
+#endif
+   free(data);
+}
+
+void renderer_free_slot(RendererSlot *slot)
+{
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+   if (slot->arena)
+      arena_release(arenas + slot->arena - 1, slot->first, slot->size);
+   else if (slot->buffer)
+   {
+      GLuint buffer = (GLuint)slot->buffer;
+      glDeleteBuffers(1, &buffer);
+      arena_dedicated--;
+   }
+#endif
+   memset(slot, 0, sizeof(RendererSlot));
+}
+
+// only once every slot has been freed
+void renderer_free_arenas(void)
+{
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+   int i;
+   for (i = 0; i < arena_count; i++)
+   {
+      glDeleteBuffers(1, &arenas[i].buffer);
+      free(arenas[i].ranges);
+   }
+   memset(arenas, 0, sizeof(arenas));
+   arena_count = 0;
+#endif
+}
+
+void renderer_get_arena_stats(RendererArenaStats *stats)
+{
+   memset(stats, 0, sizeof(RendererArenaStats));
+#if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+   {
+      int i;
+      stats->arenas = arena_count;
+      for (i = 0; i < arena_count; i++)
+      {
+         stats->reserved += ARENA_STRIDE * ARENA_VERTICES;
+         stats->used += ARENA_STRIDE * arenas[i].used;
+         stats->free_ranges += arenas[i].count;
+      }
+      stats->uploads = arena_uploads;
+      stats->in_place = arena_in_place;
+      stats->dedicated = arena_dedicated;
+   }
+#endif
+}
@@ -39,6 +39,11 @@ typedef struct
    State state;
    State state1;
    State state2;
+   // velocity sent with state2, used when reckoned is set
+   float vx;
+   float vy;
+   float vz;
+   int reckoned;
    uintptr_t buffer;
 } Player;
 
@@ -65,6 +70,28 @@ typedef struct
    uintptr_t extra4;
 } Attrib;
 
+/* Chunk and cloud meshes (10 floats a vertex) share a few large vertex
+ * buffers. A slot is the range of vertices one mesh holds in one of
+ * them, or a buffer of its own when the mesh is too big for any. */
+typedef struct
+{
+   uintptr_t buffer;
+   unsigned first;
+   unsigned size;
+   int arena;
+} RendererSlot;
+
+typedef struct
+{
+   int arenas;
+   unsigned int reserved;
+   unsigned int used;
+   unsigned int free_ranges;
+   unsigned int uploads;
+   unsigned int in_place;
+   unsigned int dedicated;
+} RendererArenaStats;
+
 struct craft_info
 {
    Attrib block_attrib;
@@ -85,6 +112,7 @@ struct craft_info
    double previous;
    double last_commit;
    double last_update;
+   double last_ping;
    FPS fps;
 };
 
@@ -205,6 +233,17 @@ void renderer_disable_polygon_offset_fill(void);
 
 void renderer_draw_triangle_arrays(enum draw_prim_type type, unsigned count);
 
+void renderer_draw_triangle_range(enum draw_prim_type type,
+      unsigned first, unsigned count);
+
+void renderer_upload_faces(RendererSlot *slot, int faces, float *data);
+
+void renderer_free_slot(RendererSlot *slot);
+
+void renderer_free_arenas(void);
+
+void renderer_get_arena_stats(RendererArenaStats *stats);
+
 void renderer_enable_scissor_test(void);
 
 void renderer_disable_scissor_test(void);
@@ -94,6 +94,18 @@ void ring_put_key(Ring *ring, int p, int q, int key)
    ring_put(ring, &entry);
 }
 
+/* the light version travels in key, the sign version in w */
+void ring_put_versions(Ring *ring, int p, int q, int lights, int signs)
+{
+   RingEntry entry;
+   entry.type = VERSIONS;
+   entry.p = p;
+   entry.q = q;
+   entry.key = lights;
+   entry.w = signs;
+   ring_put(ring, &entry);
+}
+
 void ring_put_commit(Ring *ring)
 {
    RingEntry entry;
@@ -5,6 +5,7 @@ typedef enum {
     BLOCK,
     LIGHT,
     KEY,
+    VERSIONS,
     COMMIT,
     EXIT
 } RingEntryType;
@@ -37,6 +38,7 @@ void ring_put(Ring *ring, RingEntry *entry);
 void ring_put_block(Ring *ring, int p, int q, int x, int y, int z, int w);
 void ring_put_light(Ring *ring, int p, int q, int x, int y, int z, int w);
 void ring_put_key(Ring *ring, int p, int q, int key);
+void ring_put_versions(Ring *ring, int p, int q, int lights, int signs);
 void ring_put_commit(Ring *ring);
 void ring_put_exit(Ring *ring);
 int ring_get(Ring *ring, RingEntry *entry);
@@ -0,0 +1,36 @@
+#ifndef _storage_h_
+#define _storage_h_
+
+#include "map.h"
+#include "sign.h"
+
+/* Chunk persistence backend used by db.c. The insert, light and key
+   entries are called from the db worker thread, the load entries from
+   chunk workers. A generated chunk holds its full terrain, so the client
+   does not run world generation for it. commit is passed whether it must
+   wait for the data to reach the disk. Sign entries may be left NULL, in
+   which case db.c keeps signs in the SQLite database. */
+typedef struct {
+    const char *name;
+    int (*open)(const char *path);
+    void (*close)(void);
+    void (*commit)(int sync);
+    void (*insert_block)(int p, int q, int x, int y, int z, int w);
+    void (*insert_light)(int p, int q, int x, int y, int z, int w);
+    void (*insert_sign)(
+        int p, int q, int x, int y, int z, int face, const char *text);
+    void (*delete_sign)(int x, int y, int z, int face);
+    void (*delete_signs)(int x, int y, int z);
+    void (*delete_all_signs)(void);
+    void (*load_blocks)(Map *map, int p, int q);
+    void (*load_lights)(Map *map, int p, int q);
+    void (*load_signs)(SignList *list, int p, int q);
+    int (*get_key)(int p, int q);
+    void (*set_key)(int p, int q, int key);
+    int (*get_generated)(int p, int q);
+    void (*set_generated)(int p, int q);
+} StorageBackend;
+
+extern const StorageBackend region_backend;
+
+#endif
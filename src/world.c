@@ -1,5 +1,9 @@
+#include <stdlib.h>
+#include <string.h>
 #include "config.h"
 #include "noise.h"
+#include "tinycthread.h"
+#include "util.h"
 #include "world.h"
 
 void create_world1(int p, int q, world_func func, void *arg)
@@ -87,11 +91,460 @@ void create_world1(int p, int q, world_func func, void *arg)
    }
 }
 
-void biome0(int x, int z, int flag, world_func func, void *arg)
+typedef struct {
+    world_func func;
+    world_fill_func fill;
+    void *arg;
+} WorldSink;
+
+// emits blocks y0 <= y < y1 of one column
+static void sink_fill(WorldSink *sink, int x, int z, int y0, int y1, int w)
 {
    int y;
-   float f = simplex2(x * 0.01, z * 0.01, 4, 0.5, 2);
-   float g = simplex2(-x * 0.01, -z * 0.01, 2, 0.9, 2);
+   if (y0 >= y1)
+      return;
+   if (sink->fill) {
+      sink->fill(x, z, y0, y1, w, sink->arg);
+      return;
+   }
+   for (y = y0; y < y1; y++)
+      sink->func(x, y, z, w, sink->arg);
+}
+
+#define WORLD_PAD 1
+#define WORLD_SIZE (CHUNK_SIZE + WORLD_PAD * 2)
+#define WORLD_AREA (WORLD_SIZE * WORLD_SIZE)
+#define MAX_COLUMN 64
+#define LATTICE_STEP 4
+#define LATTICE_XZ (CHUNK_SIZE / LATTICE_STEP + 3)
+#define LATTICE_Y (MAX_COLUMN / LATTICE_STEP + 1)
+#define LATTICE_SIZE (LATTICE_XZ * LATTICE_XZ * LATTICE_Y)
+#define LATTICE(x, y, z) (((x) * LATTICE_XZ + (z)) * LATTICE_Y + (y))
+#define INSIDE(dx, dz) \
+    ((dx) >= 0 && (dz) >= 0 && (dx) < CHUNK_SIZE && (dz) < CHUNK_SIZE)
+
+static int terrain = TERRAIN_EXACT;
+static int structures = 0;
+
+void world_set_terrain(int value) {
+    terrain = value;
+}
+
+void world_set_structures(int value) {
+    structures = value;
+}
+
+static int floor_div(int a, int b) {
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+#define FIELD_BIOME 0
+#define FIELD_HEIGHT 1
+#define FIELD_RANGE 2
+#define FIELD_PEAK 3
+#define FIELD_GRASS 4
+#define FIELD_FLOWER 5
+#define FIELD_FLOWER_TYPE 6
+#define NOISE_FIELDS 7
+
+#define NOISE_CACHE_SIZE 128
+#define CHUNK_AREA (CHUNK_SIZE * CHUNK_SIZE)
+
+// each field is simplex2(x * sx, z * sz, octaves, persistence, 2)
+typedef struct {
+    double sx;
+    double sz;
+    int octaves;
+    float persistence;
+} NoiseField;
+
+static const NoiseField FIELDS[NOISE_FIELDS] = {
+    {-0.001, -0.001, 8, 0.5},
+    {0.01, 0.01, 4, 0.5},
+    {-0.01, -0.01, 2, 0.9},
+    {-0.01, -0.01, 4, 0.5},
+    {-0.1, 0.1, 4, 0.8},
+    {0.05, -0.05, 4, 0.8},
+    {0.1, 0.1, 4, 0.8}
+};
+
+// 2D noise for every column of a padded chunk
+typedef struct {
+    float field[NOISE_FIELDS][WORLD_AREA];
+} ColumnNoise;
+
+// the unpadded fields of recently generated chunks, shared by workers
+typedef struct {
+    int p;
+    int q;
+    int valid;
+    unsigned int last_use;
+    float field[NOISE_FIELDS][CHUNK_AREA];
+} NoiseCacheEntry;
+
+static NoiseCacheEntry *noise_cache;
+static unsigned int noise_cache_use;
+static unsigned int noise_cache_seed;
+static WorldCacheStats noise_cache_stats;
+static mtx_t noise_cache_mtx;
+
+// Structures are placed per region of STRUCTURE_REGION chunks. Each
+// STRUCTURE_CELL square cell holds at most one tree at a position hashed
+// from the cell, so a region's trees depend only on world coordinates and
+// every chunk a tree overlaps stamps the same blocks.
+#define STRUCTURE_REGION 4
+#define STRUCTURE_BLOCKS (STRUCTURE_REGION * CHUNK_SIZE)
+#define STRUCTURE_CELL 8
+#define STRUCTURE_CELLS (STRUCTURE_BLOCKS / STRUCTURE_CELL)
+#define STRUCTURE_CACHE_SIZE 16
+#define TREE_RADIUS 3
+
+typedef struct {
+    int x;
+    int z;
+    int h;
+} Tree;
+
+typedef struct {
+    int rp;
+    int rq;
+    int valid;
+    unsigned int last_use;
+    int count;
+    Tree trees[STRUCTURE_CELLS * STRUCTURE_CELLS];
+} RegionFeatures;
+
+static RegionFeatures *structure_cache;
+static unsigned int structure_cache_use;
+static unsigned int structure_cache_seed;
+static mtx_t structure_cache_mtx;
+
+static unsigned int cell_hash(int a, int b) {
+    unsigned int h = (unsigned int)a * 374761393u + (unsigned int)b * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+}
+
+static float field_noise(int f, int x, int z) {
+    return simplex2(x * FIELDS[f].sx, z * FIELDS[f].sz,
+        FIELDS[f].octaves, FIELDS[f].persistence, 2);
+}
+
+static void region_features(int rp, int rq, RegionFeatures *region)
+{
+   int a, b;
+   region->rp = rp;
+   region->rq = rq;
+   region->count = 0;
+   for (a = 0; a < STRUCTURE_CELLS; a++) {
+      for (b = 0; b < STRUCTURE_CELLS; b++) {
+         int ca = rp * STRUCTURE_CELLS + a;
+         int cb = rq * STRUCTURE_CELLS + b;
+         unsigned int hash = cell_hash(ca, cb);
+         int x = ca * STRUCTURE_CELL + hash % STRUCTURE_CELL;
+         int z = cb * STRUCTURE_CELL + (hash >> 8) % STRUCTURE_CELL;
+         float forest = simplex2(x * 0.02, -z * 0.02, 2, 0.5, 2);
+         float chance = (forest - 0.35) * 2;
+         int h;
+         if ((hash >> 16) % 256 >= chance * 256)
+            continue;
+         // same column terrain as create_world2, trees grow on grass
+         if ((int)(field_noise(FIELD_BIOME, x, z) * 2) != 0)
+            continue;
+         h = field_noise(FIELD_HEIGHT, x, z) *
+            (int)(field_noise(FIELD_RANGE, x, z) * 32 + 16);
+         if (h <= 12)
+            continue;
+         region->trees[region->count].x = x;
+         region->trees[region->count].z = z;
+         region->trees[region->count].h = h;
+         region->count++;
+      }
+   }
+}
+
+// copies a region's features out of the cache, computing them on a miss
+static void find_features(int rp, int rq, RegionFeatures *region)
+{
+   RegionFeatures *entry;
+   int i;
+   if (!structure_cache) {
+      region_features(rp, rq, region);
+      return;
+   }
+   mtx_lock(&structure_cache_mtx);
+   if (structure_cache_seed != seed_count()) {
+      structure_cache_seed = seed_count();
+      for (i = 0; i < STRUCTURE_CACHE_SIZE; i++)
+         structure_cache[i].valid = 0;
+   }
+   for (i = 0; i < STRUCTURE_CACHE_SIZE; i++) {
+      entry = structure_cache + i;
+      if (entry->valid && entry->rp == rp && entry->rq == rq) {
+         entry->last_use = ++structure_cache_use;
+         memcpy(region, entry, sizeof(RegionFeatures));
+         mtx_unlock(&structure_cache_mtx);
+         return;
+      }
+   }
+   mtx_unlock(&structure_cache_mtx);
+   region_features(rp, rq, region);
+   mtx_lock(&structure_cache_mtx);
+   entry = structure_cache;
+   for (i = 1; i < STRUCTURE_CACHE_SIZE; i++) {
+      RegionFeatures *other = structure_cache + i;
+      if (!entry->valid)
+         break;
+      if (!other->valid || other->last_use < entry->last_use)
+         entry = other;
+   }
+   memcpy(entry, region, sizeof(RegionFeatures));
+   entry->valid = 1;
+   entry->last_use = ++structure_cache_use;
+   mtx_unlock(&structure_cache_mtx);
+}
+
+// writes the part of a tree inside the padded chunk, or only the part
+// in the padding
+static void stamp_tree(
+   int p, int q, const Tree *tree, int padding, WorldSink *sink)
+{
+   int x0 = p * CHUNK_SIZE;
+   int z0 = q * CHUNK_SIZE;
+   int y, ox, oz;
+   for (y = tree->h + 3; y < tree->h + 8; y++) {
+      for (ox = -TREE_RADIUS; ox <= TREE_RADIUS; ox++) {
+         for (oz = -TREE_RADIUS; oz <= TREE_RADIUS; oz++) {
+            int d = (ox * ox) + (oz * oz) +
+               (y - (tree->h + 4)) * (y - (tree->h + 4));
+            int dx = tree->x + ox - x0;
+            int dz = tree->z + oz - z0;
+            int flag = 1;
+            if (d >= 11)
+               continue;
+            if (dx < -WORLD_PAD || dz < -WORLD_PAD ||
+                  dx >= CHUNK_SIZE + WORLD_PAD || dz >= CHUNK_SIZE + WORLD_PAD)
+               continue;
+            if (dx < 0 || dz < 0 || dx >= CHUNK_SIZE || dz >= CHUNK_SIZE)
+               flag = -1;
+            else if (padding)
+               continue;
+            sink->func(tree->x + ox, y, tree->z + oz, 15 * flag, sink->arg);
+         }
+      }
+   }
+   {
+      int dx = tree->x - x0;
+      int dz = tree->z - z0;
+      int flag = 1;
+      if (dx < -WORLD_PAD || dz < -WORLD_PAD ||
+            dx >= CHUNK_SIZE + WORLD_PAD || dz >= CHUNK_SIZE + WORLD_PAD)
+         return;
+      if (dx < 0 || dz < 0 || dx >= CHUNK_SIZE || dz >= CHUNK_SIZE)
+         flag = -1;
+      else if (padding)
+         return;
+      for (y = tree->h; y < tree->h + 7; y++)
+         sink->func(tree->x, y, tree->z, 5 * flag, sink->arg);
+   }
+}
+
+static void create_structures(int p, int q, int padding, WorldSink *sink)
+{
+   int lo = -WORLD_PAD - TREE_RADIUS;
+   int hi = CHUNK_SIZE + WORLD_PAD + TREE_RADIUS - 1;
+   int rp0 = floor_div(p * CHUNK_SIZE + lo, STRUCTURE_BLOCKS);
+   int rq0 = floor_div(q * CHUNK_SIZE + lo, STRUCTURE_BLOCKS);
+   int rp1 = floor_div(p * CHUNK_SIZE + hi, STRUCTURE_BLOCKS);
+   int rq1 = floor_div(q * CHUNK_SIZE + hi, STRUCTURE_BLOCKS);
+   RegionFeatures *region = (RegionFeatures *)malloc(sizeof(RegionFeatures));
+   int rp, rq, i;
+   for (rp = rp0; rp <= rp1; rp++) {
+      for (rq = rq0; rq <= rq1; rq++) {
+         find_features(rp, rq, region);
+         for (i = 0; i < region->count; i++) {
+            Tree *tree = region->trees + i;
+            if (tree->x - p * CHUNK_SIZE < lo || tree->x - p * CHUNK_SIZE > hi)
+               continue;
+            if (tree->z - q * CHUNK_SIZE < lo || tree->z - q * CHUNK_SIZE > hi)
+               continue;
+            stamp_tree(p, q, tree, padding, sink);
+         }
+      }
+   }
+   free(region);
+}
+
+void world_cache_init(void) {
+    if (noise_cache)
+        return;
+    noise_cache = (NoiseCacheEntry *)calloc(
+        NOISE_CACHE_SIZE, sizeof(NoiseCacheEntry));
+    mtx_init(&noise_cache_mtx, mtx_plain);
+    structure_cache = (RegionFeatures *)calloc(
+        STRUCTURE_CACHE_SIZE, sizeof(RegionFeatures));
+    mtx_init(&structure_cache_mtx, mtx_plain);
+}
+
+void world_cache_stats(WorldCacheStats *stats) {
+    memset(stats, 0, sizeof(WorldCacheStats));
+    if (!noise_cache)
+        return;
+    mtx_lock(&noise_cache_mtx);
+    memcpy(stats, &noise_cache_stats, sizeof(WorldCacheStats));
+    mtx_unlock(&noise_cache_mtx);
+}
+
+static NoiseCacheEntry *find_noise(int p, int q) {
+    int i;
+    if (noise_cache_seed != seed_count()) {
+        noise_cache_seed = seed_count();
+        for (i = 0; i < NOISE_CACHE_SIZE; i++)
+            noise_cache[i].valid = 0;
+    }
+    for (i = 0; i < NOISE_CACHE_SIZE; i++) {
+        NoiseCacheEntry *entry = noise_cache + i;
+        if (entry->valid && entry->p == p && entry->q == q) {
+            entry->last_use = ++noise_cache_use;
+            return entry;
+        }
+    }
+    return 0;
+}
+
+static void store_noise(int p, int q, const ColumnNoise *noise) {
+    int i, f, dx;
+    NoiseCacheEntry *entry = noise_cache;
+    for (i = 1; i < NOISE_CACHE_SIZE; i++) {
+        NoiseCacheEntry *other = noise_cache + i;
+        if (!entry->valid)
+            break;
+        if (!other->valid || other->last_use < entry->last_use)
+            entry = other;
+    }
+    entry->p = p;
+    entry->q = q;
+    entry->valid = 1;
+    entry->last_use = ++noise_cache_use;
+    for (f = 0; f < NOISE_FIELDS; f++) {
+        for (dx = 0; dx < CHUNK_SIZE; dx++) {
+            memcpy(entry->field[f] + dx * CHUNK_SIZE,
+                noise->field[f] + (dx + WORLD_PAD) * WORLD_SIZE + WORLD_PAD,
+                CHUNK_SIZE * sizeof(float));
+        }
+    }
+}
+
+// with padding set only the columns around the chunk are filled in
+static void column_noise(int p, int q, int padding, ColumnNoise *noise)
+{
+   float xs[WORLD_AREA], zs[WORLD_AREA], result[WORLD_AREA];
+   int missing[WORLD_AREA];
+   NoiseCacheEntry *entries[3][3] = {{0}};
+   int total = 0;
+   int count = 0;
+   int dx, f, i, n = 0;
+   if (noise_cache) {
+      int a, b;
+      mtx_lock(&noise_cache_mtx);
+      for (a = 0; a < 3; a++)
+         for (b = 0; b < 3; b++)
+            entries[a][b] = find_noise(p + a - 1, q + b - 1);
+   }
+   // take what we can from this chunk and its neighbors
+   for (dx = -WORLD_PAD; dx < CHUNK_SIZE + WORLD_PAD; dx++) {
+      int dz;
+      int x = p * CHUNK_SIZE + dx;
+      int a = dx < 0 ? 0 : dx / CHUNK_SIZE + 1;
+      int cp = p + a - 1;
+      for (dz = -WORLD_PAD; dz < CHUNK_SIZE + WORLD_PAD; dz++) {
+         int z = q * CHUNK_SIZE + dz;
+         int b = dz < 0 ? 0 : dz / CHUNK_SIZE + 1;
+         int cq = q + b - 1;
+         NoiseCacheEntry *entry = entries[a][b];
+         if (padding && INSIDE(dx, dz)) {
+            n++;
+            continue;
+         }
+         total++;
+         if (entry) {
+            int m = (x - cp * CHUNK_SIZE) * CHUNK_SIZE + z - cq * CHUNK_SIZE;
+            for (f = 0; f < NOISE_FIELDS; f++)
+               noise->field[f][n] = entry->field[f][m];
+         }
+         else {
+            missing[count] = n;
+            count++;
+         }
+         n++;
+      }
+   }
+   if (noise_cache) {
+      noise_cache_stats.hits += total - count;
+      noise_cache_stats.misses += count;
+      mtx_unlock(&noise_cache_mtx);
+   }
+   if (count == 0)
+      return;
+   // evaluate the rest in one batch per field
+   for (f = 0; f < NOISE_FIELDS; f++) {
+      for (i = 0; i < count; i++) {
+         int x = p * CHUNK_SIZE + missing[i] / WORLD_SIZE - WORLD_PAD;
+         int z = q * CHUNK_SIZE + missing[i] % WORLD_SIZE - WORLD_PAD;
+         xs[i] = x * FIELDS[f].sx;
+         zs[i] = z * FIELDS[f].sz;
+      }
+      simplex2_batch(xs, zs, result, count,
+         FIELDS[f].octaves, FIELDS[f].persistence, 2);
+      for (i = 0; i < count; i++)
+         noise->field[f][missing[i]] = result[i];
+   }
+   if (noise_cache && !padding) {
+      mtx_lock(&noise_cache_mtx);
+      if (!find_noise(p, q))
+         store_noise(p, q, noise);
+      mtx_unlock(&noise_cache_mtx);
+   }
+}
+
+int create_clouds(int p, int q, unsigned char *clouds)
+{
+   float xs[CLOUD_WIDTH], zs[CLOUD_WIDTH], density[CLOUD_WIDTH];
+   int mid = (CLOUD_LO + CLOUD_HI) / 2;
+   int a, b, count = 0;
+   memset(clouds, 0, CLOUD_WIDTH * CLOUD_WIDTH);
+   if (!SHOW_CLOUDS)
+      return 0;
+   for (a = 0; a < CLOUD_WIDTH; a++) {
+      int x = p * CHUNK_SIZE - 1 + a;
+      for (b = 0; b < CLOUD_WIDTH; b++) {
+         xs[b] = x * 0.01;
+         zs[b] = (q * CHUNK_SIZE - 1 + b) * 0.01;
+      }
+      simplex2_batch(xs, zs, density, CLOUD_WIDTH, 8, 0.5, 2);
+      for (b = 0; b < CLOUD_WIDTH; b++) {
+         // denser columns are thicker, centered on the cloud layer
+         int half = (density[b] - 0.72) * 40 + 1;
+         int y;
+         if (density[b] <= 0.72)
+            continue;
+         half = MIN(half, mid - CLOUD_LO);
+         for (y = mid - half; y < mid + half; y++)
+            clouds[a * CLOUD_WIDTH + b] |= 1 << (y - CLOUD_LO);
+         if (a >= 1 && a <= CHUNK_SIZE && b >= 1 && b <= CHUNK_SIZE)
+            count += half * 2;
+      }
+   }
+   return count;
+}
+
+void biome0(int x, int z, int flag, const ColumnNoise *noise, int n,
+      WorldSink *sink)
+{
+   world_func func = sink->func;
+   void *arg = sink->arg;
+   float f = noise->field[FIELD_HEIGHT][n];
+   float g = noise->field[FIELD_RANGE][n];
    int mh = g * 32 + 16;
    int h = f * mh;
    int w = 1;
@@ -101,109 +554,197 @@ void biome0(int x, int z, int flag, world_func func, void *arg)
       w = 2;
    }
    // sand and grass terrain
-   for (y = 0; y < h; y++) {
-      func(x, y, z, w * flag, arg);
-   }
+   sink_fill(sink, x, z, 0, h, w * flag);
    if (w == 1) {
-      int ok = 0;//SHOW_TREES;
       if (SHOW_PLANTS) {
          // grass
-         if (simplex2(-x * 0.1, z * 0.1, 4, 0.8, 2) > 0.6) {
+         if (noise->field[FIELD_GRASS][n] > 0.6) {
             func(x, h, z, 17 * flag, arg);
          }
          // flowers
-         if (simplex2(x * 0.05, -z * 0.05, 4, 0.8, 2) > 0.7) {
-            int w = 18 + simplex2(x * 0.1, z * 0.1, 4, 0.8, 2) * 7;
+         if (noise->field[FIELD_FLOWER][n] > 0.7) {
+            int w = 18 + noise->field[FIELD_FLOWER_TYPE][n] * 7;
             func(x, h, z, w * flag, arg);
          }
       }
-      // trees
-      // if (dx - 4 < 0 || dz - 4 < 0 ||
-      //     dx + 4 >= CHUNK_SIZE || dz + 4 >= CHUNK_SIZE)
-      // {
-      //     ok = 0;
-      // }
-      if (ok && simplex2(x, z, 6, 0.5, 2) > 0.84) {
-         int y;
-         for (y = h + 3; y < h + 8; y++) {
-            int ox;
-            for (ox = -3; ox <= 3; ox++) {
-               int oz;
-               for (oz = -3; oz <= 3; oz++) {
-                  int d = (ox * ox) + (oz * oz) +
-                     (y - (h + 4)) * (y - (h + 4));
-                  if (d < 11) {
-                     func(x + ox, y, z + oz, 15, arg);
-                  }
-               }
-            }
-         }
+   }
+}
 
-         for (y = h; y < h + 7; y++)
-            func(x, y, z, 5, arg);
+// biome1's 3D noise sampled every LATTICE_STEP blocks, aligned to world
+// coordinates so neighboring chunks agree on their shared padding
+typedef struct {
+    int x0;
+    int z0;
+    float material[LATTICE_SIZE];
+    float density[LATTICE_SIZE];
+} NoiseLattice;
+
+static void noise_lattice(int p, int q, NoiseLattice *lattice)
+{
+   float xs[LATTICE_SIZE], ys[LATTICE_SIZE], zs[LATTICE_SIZE];
+   int a, b, c, n;
+   lattice->x0 = floor_div(p * CHUNK_SIZE - WORLD_PAD, LATTICE_STEP);
+   lattice->z0 = floor_div(q * CHUNK_SIZE - WORLD_PAD, LATTICE_STEP);
+   for (a = 0; a < LATTICE_XZ; a++) {
+      for (b = 0; b < LATTICE_XZ; b++) {
+         for (c = 0; c < LATTICE_Y; c++) {
+            n = LATTICE(a, c, b);
+            xs[n] = -(lattice->x0 + a) * LATTICE_STEP * 0.01;
+            ys[n] = -c * LATTICE_STEP * 0.01;
+            zs[n] = -(lattice->z0 + b) * LATTICE_STEP * 0.01;
+         }
       }
    }
-   // clouds
-   if (SHOW_CLOUDS)
-   {
-      int y;
-      for (y = 64; y < 72; y++)
-      {
-         if (simplex3(
-                  x * 0.01, y * 0.1, z * 0.01, 8, 0.5, 2) > 0.75)
-            func(x, y, z, 16 * flag, arg);
-      }
+   simplex3_batch(xs, ys, zs, lattice->material, LATTICE_SIZE, 4, 0.5, 2);
+   for (n = 0; n < LATTICE_SIZE; n++) {
+      xs[n] = -xs[n];
+      ys[n] = -ys[n];
+      zs[n] = -zs[n];
+   }
+   simplex3_batch(xs, ys, zs, lattice->density, LATTICE_SIZE, 4, 0.5, 2);
+}
+
+// trilinear interpolation of one column of the lattice
+static void lattice_column(
+   const float *values, const NoiseLattice *lattice,
+   int x, int z, int lo, int hi, float *result)
+{
+   int y;
+   int a = floor_div(x, LATTICE_STEP);
+   int b = floor_div(z, LATTICE_STEP);
+   float fx = (float)(x - a * LATTICE_STEP) / LATTICE_STEP;
+   float fz = (float)(z - b * LATTICE_STEP) / LATTICE_STEP;
+   a -= lattice->x0;
+   b -= lattice->z0;
+   for (y = lo; y < hi; y++) {
+      int c = y / LATTICE_STEP;
+      float fy = (float)(y - c * LATTICE_STEP) / LATTICE_STEP;
+      float v00 = values[LATTICE(a, c, b)] * (1 - fx) +
+         values[LATTICE(a + 1, c, b)] * fx;
+      float v01 = values[LATTICE(a, c, b + 1)] * (1 - fx) +
+         values[LATTICE(a + 1, c, b + 1)] * fx;
+      float v10 = values[LATTICE(a, c + 1, b)] * (1 - fx) +
+         values[LATTICE(a + 1, c + 1, b)] * fx;
+      float v11 = values[LATTICE(a, c + 1, b + 1)] * (1 - fx) +
+         values[LATTICE(a + 1, c + 1, b + 1)] * fx;
+      float v0 = v00 * (1 - fz) + v01 * fz;
+      float v1 = v10 * (1 - fz) + v11 * fz;
+      result[y - lo] = v0 * (1 - fy) + v1 * fy;
    }
 }
 
-void biome1(int x, int z, int flag, world_func func, void *arg)
+void biome1(int x, int z, int flag, const ColumnNoise *noise, int n,
+      const NoiseLattice *lattice, WorldSink *sink)
 {
+   float xs[MAX_COLUMN], ys[MAX_COLUMN], zs[MAX_COLUMN];
+   float material[MAX_COLUMN], density[MAX_COLUMN];
    int y;
-   int lo = simplex2(x * 0.01, z * 0.01, 4, 0.5, 2) * 8 + 8;
-   int hi = simplex2(-x * 0.01, -z * 0.01, 4, 0.5, 2) * 32 + 32;
+   int lo = noise->field[FIELD_HEIGHT][n] * 8 + 8;
+   int hi = noise->field[FIELD_PEAK][n] * 32 + 32;
    int lookup[] = {3, 6, 11, 12, 13};
-   for (y = 0; y < lo; y++)
-      func(x, y, z, 6 * flag, arg);
+   sink_fill(sink, x, z, 0, lo, 6 * flag);
 
-   for (y = lo; y < hi; y++)
+   hi = MIN(hi, MAX_COLUMN);
+   if (lattice && lo < hi)
    {
-      int i = simplex3(-x * 0.01, -y * 0.01, -z * 0.01, 4, 0.5, 2) * 10;
-      int w = lookup[i % 5];
-      if (simplex3(x * 0.01, y * 0.01, z * 0.01, 4, 0.5, 2) > 0.5)
-         func(x, y, z, w * flag, arg);
+      lattice_column(lattice->material, lattice, x, z, lo, hi, material);
+      lattice_column(lattice->density, lattice, x, z, lo, hi, density);
    }
-
-   if (SHOW_CLOUDS)
+   else if (lo < hi)
    {
-      for (y = 64; y < 72; y++)
+      for (y = lo; y < hi; y++)
+      {
+         xs[y - lo] = -x * 0.01;
+         ys[y - lo] = -y * 0.01;
+         zs[y - lo] = -z * 0.01;
+      }
+      simplex3_batch(xs, ys, zs, material, hi - lo, 4, 0.5, 2);
+      for (y = lo; y < hi; y++)
       {
-         if (simplex3(
-                  x * 0.01, y * 0.1, z * 0.01, 8, 0.5, 2) > 0.75)
-            func(x, y, z, 16 * flag, arg);
+         xs[y - lo] = x * 0.01;
+         ys[y - lo] = y * 0.01;
+         zs[y - lo] = z * 0.01;
       }
+      simplex3_batch(xs, ys, zs, density, hi - lo, 4, 0.5, 2);
+   }
+
+   for (y = lo; y < hi; y++)
+   {
+      int i = material[y - lo] * 10;
+      int w = lookup[i % 5];
+      if (density[y - lo] > 0.5)
+         sink->func(x, y, z, w * flag, sink->arg);
    }
 }
 
-void create_world2(int p, int q, world_func func, void *arg) {
-   int dx;
-    int pad = 1;
-    for (dx = -pad; dx < CHUNK_SIZE + pad; dx++) {
+// with padding set only the blocks around the chunk are made
+void create_world2(int p, int q, int padding, WorldSink *sink) {
+   ColumnNoise noise;
+   NoiseLattice *lattice = 0;
+   int dx, n = 0;
+   column_noise(p, q, padding, &noise);
+   if (terrain == TERRAIN_FAST) {
+      for (n = 0; n < WORLD_AREA; n++) {
+         if (padding && INSIDE(
+               n / WORLD_SIZE - WORLD_PAD, n % WORLD_SIZE - WORLD_PAD))
+            continue;
+         if ((int)(noise.field[FIELD_BIOME][n] * 2) != 0) {
+            lattice = (NoiseLattice *)malloc(sizeof(NoiseLattice));
+            noise_lattice(p, q, lattice);
+            break;
+         }
+      }
+      n = 0;
+   }
+    for (dx = -WORLD_PAD; dx < CHUNK_SIZE + WORLD_PAD; dx++) {
        int dz;
-        for (dz = -pad; dz < CHUNK_SIZE + pad; dz++) {
+        for (dz = -WORLD_PAD; dz < CHUNK_SIZE + WORLD_PAD; dz++) {
            int x, z, i;
             int flag = 1;
             if (dx < 0 || dz < 0 || dx >= CHUNK_SIZE || dz >= CHUNK_SIZE) {
                 flag = -1;
             }
+            else if (padding) {
+                n++;
+                continue;
+            }
             x = p * CHUNK_SIZE + dx;
             z = q * CHUNK_SIZE + dz;
-            i = simplex2(-x * 0.001, -z * 0.001, 8, 0.5, 2) * 2;
-            if (i == 0) biome0(x, z, flag, func, arg);
-            else biome1(x, z, flag, func, arg);
+            i = noise.field[FIELD_BIOME][n] * 2;
+            if (i == 0) biome0(x, z, flag, &noise, n, sink);
+            else biome1(x, z, flag, &noise, n, lattice, sink);
+            n++;
         }
     }
+    free(lattice);
+    if (structures && SHOW_TREES)
+        create_structures(p, q, padding, sink);
 }
 
 void create_world(int p, int q, world_func func, void *arg) {
-    create_world2(p, q, func, arg);
+    WorldSink sink;
+    sink.func = func;
+    sink.fill = 0;
+    sink.arg = arg;
+    create_world2(p, q, 0, &sink);
+}
+
+void create_world_fill(
+    int p, int q, world_func func, world_fill_func fill, void *arg)
+{
+    WorldSink sink;
+    sink.func = func;
+    sink.fill = fill;
+    sink.arg = arg;
+    create_world2(p, q, 0, &sink);
+}
+
+void create_world_padding(
+    int p, int q, world_func func, world_fill_func fill, void *arg)
+{
+    WorldSink sink;
+    sink.func = func;
+    sink.fill = fill;
+    sink.arg = arg;
+    create_world2(p, q, 1, &sink);
 }
@@ -2,7 +2,34 @@
 #define _world_h_
 
 typedef void (*world_func)(int, int, int, int, void *);
+// fills blocks y0 <= y < y1 of the column at x, z
+typedef void (*world_fill_func)(int, int, int, int, int, void *);
 
+// clouds are not blocks, create_clouds describes a chunk plus a one
+// block border as one byte per column, bit y - CLOUD_LO set where the
+// column holds cloud, and returns the number of cloud blocks in the chunk
+#define CLOUD_LO 64
+#define CLOUD_HI 72
+#define CLOUD_WIDTH (CHUNK_SIZE + 2)
+
+#define TERRAIN_EXACT 0
+#define TERRAIN_FAST 1
+
+typedef struct {
+    unsigned int hits;
+    unsigned int misses;
+} WorldCacheStats;
+
+void world_set_terrain(int terrain);
+void world_set_structures(int enabled);
+void world_cache_init(void);
+void world_cache_stats(WorldCacheStats *stats);
 void create_world(int p, int q, world_func func, void *arg);
+void create_world_fill(
+    int p, int q, world_func func, world_fill_func fill, void *arg);
+// only the one block border around the chunk, for chunks stored whole
+void create_world_padding(
+    int p, int q, world_func func, world_fill_func fill, void *arg);
+int create_clouds(int p, int q, unsigned char *clouds);
 
 #endif
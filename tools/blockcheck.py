@@ -0,0 +1,93 @@
+# Checks that the server commits the accepted part of a block batch.
+#
+# usage: python tools/blockcheck.py [host [port]]
+#
+# Against a running server that lets guests build (AUTH_REQUIRED =
+# False in config.py), sends one M batch that places a block in the air
+# next to two edits the server must reject: removing a block from an
+# empty space and placing an item that is not allowed. The sender must
+# get the rejected cells back, and a second connection must see the
+# placed block. The block is removed again afterwards.
+
+import random
+import socket
+import sys
+import time
+
+DEFAULT_HOST = '127.0.0.1'
+DEFAULT_PORT = 4080
+BUFFER_SIZE = 65536
+TIMEOUT = 5
+
+def connect(host, port):
+    conn = socket.create_connection((host, port))
+    conn.settimeout(TIMEOUT)
+    conn.sendall('V,1\n')
+    return conn
+
+def wait_for(conn, data, end):
+    # reads lines until one starts with end, returns all lines read
+    lines = []
+    start = time.time()
+    while True:
+        while '\n' in data[0]:
+            line, data[0] = data[0].split('\n', 1)
+            lines.append(line)
+            if line.startswith(end):
+                return lines
+        if time.time() - start > TIMEOUT:
+            raise Exception('timed out waiting for %s' % end)
+        chunk = conn.recv(BUFFER_SIZE)
+        if not chunk:
+            raise Exception('connection closed')
+        data[0] += chunk
+
+def chunk_blocks(host, port, p, q):
+    conn = connect(host, port)
+    data = ['']
+    conn.sendall('C,%d,%d,0\n' % (p, q))
+    lines = wait_for(conn, data, 'C,%d,%d' % (p, q))
+    conn.close()
+    blocks = {}
+    for line in lines:
+        if line.startswith('B,'):
+            bp, bq, x, y, z, w = map(int, line.split(',')[1:7])
+            if (bp, bq) == (p, q):
+                blocks[(x, y, z)] = w
+    return blocks
+
+def main():
+    args = sys.argv[1:]
+    host = args[0] if len(args) > 0 else DEFAULT_HOST
+    port = int(args[1]) if len(args) > 1 else DEFAULT_PORT
+    x, y, z = random.randrange(32), random.randrange(150, 250), \
+        random.randrange(32)
+    placed = (x, y, z)
+    empty = (x, y + 1, z)
+    disallowed = (x, y + 2, z)
+    conn = connect(host, port)
+    data = ['']
+    conn.sendall('M,0,0,%d,%d,%d,1,%d,%d,%d,0,%d,%d,%d,200\nQ,blockcheck\n' % (
+        placed + empty + disallowed))
+    lines = wait_for(conn, data, 'Q,blockcheck')
+    corrected = set()
+    for line in lines:
+        if line.startswith('B,0,0,'):
+            corrected.add(tuple(map(int, line.split(',')[3:6])))
+    ok = True
+    if corrected != set([empty, disallowed]):
+        print 'FAIL: sender got corrections for %s' % sorted(corrected)
+        ok = False
+    blocks = chunk_blocks(host, port, 0, 0)
+    if blocks.get(placed) != 1:
+        print 'FAIL: placed block not committed, is %s' % blocks.get(placed)
+        ok = False
+    conn.sendall('B,%d,%d,%d,0\nQ,blockcheck\n' % placed)
+    wait_for(conn, data, 'Q,blockcheck')
+    conn.close()
+    if not ok:
+        sys.exit(1)
+    print 'ok: accepted edit committed, rejected edits corrected'
+
+if __name__ == '__main__':
+    main()
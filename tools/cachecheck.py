@@ -0,0 +1,53 @@
+# Checks server.ChunkCache's bookkeeping in process.
+#
+# usage: python tools/cachecheck.py [-n puts]
+#
+# Puts the same key twice, the way two reader threads that both missed
+# on a chunk do, then puts random keys and sizes into a small cache and
+# checks after every put that size is what the entries add up to.
+
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+from server import ChunkCache
+
+USAGE = 'usage: python tools/cachecheck.py [-n puts]'
+
+def check(cache):
+    size = sum(len(data) for data in cache.entries.itervalues())
+    if cache.size != size:
+        print 'MISMATCH: size %d, entries add up to %d' % (cache.size, size)
+        sys.exit(1)
+    if cache.size > cache.capacity:
+        print 'OVER CAPACITY: %d of %d' % (cache.size, cache.capacity)
+        sys.exit(1)
+
+def main():
+    args = sys.argv[1:]
+    count = 10000
+    if args:
+        if args[0] != '-n' or len(args) != 2:
+            print USAGE
+            sys.exit(1)
+        count = int(args[1])
+    cache = ChunkCache(100 * 1024)
+    key = (0, 0, 1, 0, 0, 0)
+    cache.put(key, 'a' * 1000)
+    cache.put(key, 'b' * 600)
+    check(cache)
+    if cache.size != 600 or cache.get(key) != 'b' * 600:
+        print 'SAME KEY: size %d after putting it twice' % cache.size
+        sys.exit(1)
+    rand = random.Random(1)
+    for i in xrange(count):
+        key = (rand.randrange(50), 0, 1, 0, 0, 0)
+        cache.put(key, 'x' * rand.randrange(1, 20 * 1024))
+        if rand.random() < 0.1:
+            cache.invalidate(key[0], key[1])
+        check(cache)
+    print '%d puts, %s' % (count + 2, cache.stats())
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,88 @@
+# Measures what chunk requests cost against a running server.
+#
+# usage: python tools/chunkload.py [host [port [radius]]]
+#
+# Requests the (2 * radius + 1) ** 2 chunks around the origin three
+# times over fresh connections: with an empty cache, again with the
+# versions the first pass returned (a rejoin with a warm cache), and
+# with only block keys the way text protocol clients ask.
+
+import socket
+import struct
+import sys
+import time
+
+DEFAULT_HOST = '127.0.0.1'
+DEFAULT_PORT = 4080
+BUFFER_SIZE = 65536
+
+def connect(host, port):
+    conn = socket.create_connection((host, port))
+    conn.sendall('V,1\nV,2\n')
+    data = ''
+    while 'V,2\n' not in data:
+        chunk = conn.recv(BUFFER_SIZE)
+        if not chunk:
+            raise Exception('server does not speak the binary protocol')
+        data += chunk
+    return conn, data[data.index('V,2\n') + 4:]
+
+def request(host, port, chunks, requests):
+    conn, data = connect(host, port)
+    start = time.time()
+    conn.sendall(''.join(requests))
+    received = len(data)
+    versions = {}
+    pending = len(chunks)
+    frames = 0
+    while pending:
+        while len(data) >= 5:
+            command, size = struct.unpack('<cI', data[:5])
+            if len(data) < 5 + size:
+                break
+            payload, data = data[5:5 + size], data[5 + size:]
+            frames += 1
+            if command == 'K' and size == 20:
+                p, q, key, lights, signs = struct.unpack('<5i', payload)
+                versions[(p, q)] = (key, lights, signs)
+            elif command == '#' and payload.startswith('C,'):
+                pending -= 1
+        if not pending:
+            break
+        chunk = conn.recv(BUFFER_SIZE)
+        if not chunk:
+            raise Exception('connection closed')
+        received += len(chunk)
+        data += chunk
+    elapsed = time.time() - start
+    conn.close()
+    return received, frames, elapsed, versions
+
+def report(name, chunks, result):
+    received, frames, elapsed, versions = result
+    print '%-8s %9d bytes %7.1f bytes/chunk %6d frames %8.1f ms' % (
+        name, received, float(received) / len(chunks), frames,
+        elapsed * 1000)
+
+def main():
+    args = sys.argv[1:]
+    host = args[0] if len(args) > 0 else DEFAULT_HOST
+    port = int(args[1]) if len(args) > 1 else DEFAULT_PORT
+    radius = int(args[2]) if len(args) > 2 else 4
+    chunks = [(p, q) for p in xrange(-radius, radius + 1)
+        for q in xrange(-radius, radius + 1)]
+    cold = request(host, port, chunks,
+        ['C,%d,%d,0,0,0\n' % chunk for chunk in chunks])
+    report('cold', chunks, cold)
+    versions = cold[3]
+    warm = request(host, port, chunks,
+        ['C,%d,%d,%d,%d,%d\n' % (chunk + versions.get(chunk, (0, 0, 0)))
+        for chunk in chunks])
+    report('warm', chunks, warm)
+    keys = request(host, port, chunks,
+        ['C,%d,%d,%d\n' % (chunk + versions.get(chunk, (0,))[:1])
+        for chunk in chunks])
+    report('key only', chunks, keys)
+
+if __name__ == '__main__':
+    main()
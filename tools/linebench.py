@@ -0,0 +1,101 @@
+# Measures how fast the server splits what one connection sends into
+# lines.
+#
+# usage: python tools/linebench.py [-n lines] [host [port]]
+#        python tools/linebench.py -l [-n lines]
+#
+# Against a running server, sends a burst of lines the size of block
+# edits, with a command the server ignores, followed by a ping, and
+# times the burst until the ping comes back. With -l, feeds the same
+# burst to server.LineBuffer in process, in the chunks a connection
+# receives it in, and to the list based splitter it replaced.
+
+import os
+import socket
+import sys
+import time
+
+USAGE = 'usage: python tools/linebench.py [-l] [-n lines] [host [port]]'
+DEFAULT_HOST = '127.0.0.1'
+DEFAULT_PORT = 4080
+BUFFER_SIZE = 4096
+
+def make_burst(count):
+    return ''.join('X,%d,%d,%d,%d\n' % (i % 32, 12 + i % 64, i / 32 % 32, 1)
+        for i in xrange(count))
+
+def split_list(data):
+    # the previous splitter, quadratic in the size of a burst
+    lines = []
+    buf = []
+    for i in xrange(0, len(data), BUFFER_SIZE):
+        buf.extend(data[i:i + BUFFER_SIZE].replace('\r\n', '\n'))
+        while '\n' in buf:
+            index = buf.index('\n')
+            lines.append(''.join(buf[:index]))
+            buf = buf[index + 1:]
+    return lines
+
+def split_buffer(data):
+    from server import LineBuffer
+    lines = []
+    buf = LineBuffer()
+    for i in xrange(0, len(data), BUFFER_SIZE):
+        lines.extend(buf.feed(data[i:i + BUFFER_SIZE]))
+    return lines
+
+def local(count):
+    sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+    burst = make_burst(count)
+    results = []
+    for name, func in (('list', split_list), ('bytearray', split_buffer)):
+        start = time.time()
+        lines = func(burst)
+        elapsed = time.time() - start
+        results.append(lines)
+        print '%-10s %8d lines %8.1f ms %10.0f lines/sec' % (
+            name, len(lines), elapsed * 1000, len(lines) / max(elapsed, 1e-9))
+    if results[0] != results[1]:
+        print 'MISMATCH'
+        sys.exit(1)
+
+def remote(host, port, count):
+    conn = socket.create_connection((host, port))
+    conn.sendall('V,1\n')
+    burst = make_burst(count)
+    start = time.time()
+    conn.sendall(burst + 'Q,linebench\n')
+    data = ''
+    while 'Q,linebench\n' not in data:
+        chunk = conn.recv(65536)
+        if not chunk:
+            raise Exception('connection closed')
+        data = data[-64:] + chunk
+    elapsed = time.time() - start
+    conn.close()
+    print '%d lines, %d bytes in %.1f ms: %.0f lines/sec' % (
+        count, len(burst), elapsed * 1000, count / elapsed)
+
+def main():
+    args = sys.argv[1:]
+    count = 100000
+    in_process = False
+    while args and args[0].startswith('-'):
+        if args[0] == '-l':
+            in_process = True
+            args = args[1:]
+        elif args[0] == '-n' and len(args) > 1:
+            count = int(args[1])
+            args = args[2:]
+        else:
+            print USAGE
+            sys.exit(1)
+    if in_process:
+        local(count)
+        return
+    host = args[0] if len(args) > 0 else DEFAULT_HOST
+    port = int(args[1]) if len(args) > 1 else DEFAULT_PORT
+    remote(host, port, count)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,820 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "../src/client.h"
+#include "../src/config.h"
+#include "../src/perf.h"
+#include "../src/protocol.h"
+#include "../src/util.h"
+#include "tinycthread.h"
+
+/* Drives the client's networking code without server.py. A stand-in
+   server running in this process answers the chunk, block and position
+   subset of the protocol on a loopback socket, headless bots walk around
+   it and build, and one client, the real client.c, joins, loads the
+   chunks around it and then receives and parses what the bots cause.
+
+   usage: craft-loadgen [-c bots] [-s seconds] [-r radius] [-k blocks] [-b]
+
+   -r is the chunk radius everybody loads, -k the blocks of terrain the
+   server sends for each chunk and -b makes it answer V,2 and send binary
+   frames the way server.py does. POSIX only. */
+
+#define MAX_BOTS 256
+#define MAX_CONNECTIONS (MAX_BOTS + 2)
+#define BUFFER_SIZE 65536
+#define TICK 0.1
+#define BUILD_EVERY 5
+#define WALK_SPEED 4.0
+#define SPAWN_RANGE 48
+#define FRAME_RUN 4096
+
+typedef struct {
+    char *data;
+    int length;
+    int capacity;
+} Buffer;
+
+typedef struct {
+    int x;
+    int y;
+    int z;
+    int w;
+    int key;
+} Edit;
+
+typedef struct {
+    int p;
+    int q;
+    int key;
+    int count;
+    int capacity;
+    Edit *edits;
+} Chunk;
+
+typedef struct {
+    int sd;
+    int id;
+    int binary;
+    Buffer in;
+    Buffer out;
+} Connection;
+
+typedef struct {
+    int listener;
+    int port;
+    int binary;
+    int terrain;
+    int next_id;
+    int connection_count;
+    Connection connections[MAX_CONNECTIONS];
+    int chunk_count;
+    int chunk_capacity;
+    Chunk *chunks;
+    unsigned long lines_in;
+    unsigned long messages_out;
+    unsigned long bytes_out;
+    unsigned long sends;
+} Server;
+
+typedef struct {
+    int index;
+    int port;
+    int radius;
+    unsigned long bytes_received;
+    unsigned long lines_sent;
+} Bot;
+
+static volatile int stopping = 0;
+
+static void sleep_for(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+static int chunked(int x) {
+    return (int)floorf((float)x / CHUNK_SIZE);
+}
+
+static void buffer_append(Buffer *buffer, const char *data, int length) {
+    if (buffer->length + length > buffer->capacity) {
+        buffer->capacity = MAX(buffer->capacity * 2,
+            buffer->length + length + BUFFER_SIZE);
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void buffer_consume(Buffer *buffer, int length) {
+    buffer->length -= length;
+    memmove(buffer->data, buffer->data + length, buffer->length);
+}
+
+static void put_int(char *data, int value) {
+    unsigned int v = (unsigned int)value;
+    data[0] = v & 0xff;
+    data[1] = (v >> 8) & 0xff;
+    data[2] = (v >> 16) & 0xff;
+    data[3] = (v >> 24) & 0xff;
+}
+
+static void put_short(char *data, int value) {
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+}
+
+static void put_float(char *data, float value) {
+    unsigned int v;
+    memcpy(&v, &value, sizeof(v));
+    put_int(data, (int)v);
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in address;
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (sd < 0 || connect(sd, (struct sockaddr *)&address, sizeof(address))) {
+        perror("craft-loadgen: connect");
+        exit(1);
+    }
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+    return sd;
+}
+
+static int send_all(int sd, const char *data, int length) {
+    while (length > 0) {
+        int n = send(sd, data, length, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* the server, one thread polling non-blocking sockets */
+
+static Chunk *find_chunk(Server *server, int p, int q) {
+    Chunk *chunk;
+    int i;
+    for (i = 0; i < server->chunk_count; i++) {
+        chunk = server->chunks + i;
+        if (chunk->p == p && chunk->q == q) {
+            return chunk;
+        }
+    }
+    if (server->chunk_count == server->chunk_capacity) {
+        server->chunk_capacity = MAX(64, server->chunk_capacity * 2);
+        server->chunks = realloc(
+            server->chunks, server->chunk_capacity * sizeof(Chunk));
+    }
+    chunk = server->chunks + server->chunk_count++;
+    memset(chunk, 0, sizeof(Chunk));
+    chunk->p = p;
+    chunk->q = q;
+    chunk->key = 1;
+    return chunk;
+}
+
+static void queue_text(Server *server, Connection *c, const char *line) {
+    int length = strlen(line);
+    if (c->binary) {
+        char header[FRAME_HEADER];
+        header[0] = FRAME_TEXT;
+        put_int(header + 1, length - 1);
+        buffer_append(&c->out, header, FRAME_HEADER);
+        buffer_append(&c->out, line, length - 1);
+        server->bytes_out += FRAME_HEADER + length - 1;
+    }
+    else {
+        buffer_append(&c->out, line, length);
+        server->bytes_out += length;
+    }
+    server->messages_out++;
+}
+
+static void queue_frame(
+    Server *server, Connection *c, char type, const char *data, int length)
+{
+    char header[FRAME_HEADER];
+    header[0] = type;
+    put_int(header + 1, length);
+    buffer_append(&c->out, header, FRAME_HEADER);
+    buffer_append(&c->out, data, length);
+    server->bytes_out += FRAME_HEADER + length;
+    server->messages_out++;
+}
+
+/* blocks of one chunk, as B lines or as runs of B frames */
+static void queue_blocks(
+    Server *server, Connection *c, int p, int q, const Edit *blocks, int count)
+{
+    static char run[8 + FRAME_RUN * FRAME_BLOCK];
+    char line[128];
+    int i, j;
+    if (!c->binary) {
+        for (i = 0; i < count; i++) {
+            snprintf(line, sizeof(line), "B,%d,%d,%d,%d,%d,%d\n",
+                p, q, blocks[i].x, blocks[i].y, blocks[i].z, blocks[i].w);
+            queue_text(server, c, line);
+        }
+        return;
+    }
+    for (i = 0; i < count; i += FRAME_RUN) {
+        int n = MIN(FRAME_RUN, count - i);
+        put_int(run, p);
+        put_int(run + 4, q);
+        for (j = 0; j < n; j++) {
+            const Edit *e = blocks + i + j;
+            char *data = run + 8 + j * FRAME_BLOCK;
+            put_short(data, e->x - p * CHUNK_SIZE);
+            put_short(data + 2, e->y);
+            put_short(data + 4, e->z - q * CHUNK_SIZE);
+            put_short(data + 6, e->w);
+        }
+        queue_frame(server, c, 'B', run, 8 + n * FRAME_BLOCK);
+    }
+}
+
+/* made up ground, the same for every request */
+static void queue_terrain(Server *server, Connection *c, int p, int q) {
+    static Edit *blocks = 0;
+    static int count = 0;
+    int i;
+    if (count != server->terrain) {
+        count = server->terrain;
+        blocks = realloc(blocks, MAX(count, 1) * sizeof(Edit));
+    }
+    for (i = 0; i < count; i++) {
+        blocks[i].x = p * CHUNK_SIZE + i % CHUNK_SIZE;
+        blocks[i].z = q * CHUNK_SIZE + (i / CHUNK_SIZE) % CHUNK_SIZE;
+        blocks[i].y = 10 + i / (CHUNK_SIZE * CHUNK_SIZE);
+        blocks[i].w = 1 + i % 3;
+    }
+    queue_blocks(server, c, p, q, blocks, count);
+}
+
+static void on_chunk(Server *server, Connection *c, int p, int q, int key) {
+    Chunk *chunk = find_chunk(server, p, q);
+    char line[128];
+    int i;
+    if (key < 1) {
+        queue_terrain(server, c, p, q);
+    }
+    for (i = 0; i < chunk->count && chunk->edits[i].key <= key; i++);
+    queue_blocks(server, c, p, q, chunk->edits + i, chunk->count - i);
+    if (key < chunk->key) {
+        if (c->binary) {
+            char data[20];
+            put_int(data, p);
+            put_int(data + 4, q);
+            put_int(data + 8, chunk->key);
+            put_int(data + 12, 0);
+            put_int(data + 16, 0);
+            queue_frame(server, c, 'K', data, 20);
+        }
+        else {
+            snprintf(line, sizeof(line), "K,%d,%d,%d\n", p, q, chunk->key);
+            queue_text(server, c, line);
+        }
+    }
+    snprintf(line, sizeof(line), "C,%d,%d\n", p, q);
+    queue_text(server, c, line);
+}
+
+static void on_block(Server *server, int x, int y, int z, int w) {
+    int p = chunked(x);
+    int q = chunked(z);
+    Chunk *chunk = find_chunk(server, p, q);
+    Edit *edit;
+    int i;
+    if (chunk->count == chunk->capacity) {
+        chunk->capacity = MAX(16, chunk->capacity * 2);
+        chunk->edits = realloc(chunk->edits, chunk->capacity * sizeof(Edit));
+    }
+    edit = chunk->edits + chunk->count++;
+    edit->x = x;
+    edit->y = y;
+    edit->z = z;
+    edit->w = w;
+    edit->key = ++chunk->key;
+    for (i = 0; i < server->connection_count; i++) {
+        queue_blocks(server, server->connections + i, p, q, edit, 1);
+    }
+}
+
+static void on_position(
+    Server *server, Connection *sender, const float *f, int count)
+{
+    char line[256];
+    char data[36];
+    int i;
+    snprintf(line, sizeof(line), "P,%d,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+        sender->id, f[0], f[1], f[2], f[3], f[4]);
+    put_int(data, sender->id);
+    for (i = 0; i < 8; i++) {
+        put_float(data + 4 + i * 4, i < count ? f[i] : 0);
+    }
+    for (i = 0; i < server->connection_count; i++) {
+        Connection *c = server->connections + i;
+        if (c == sender) {
+            continue;
+        }
+        if (c->binary) {
+            queue_frame(server, c, 'P', data, 36);
+        }
+        else {
+            queue_text(server, c, line);
+        }
+    }
+}
+
+static void on_line(Server *server, Connection *c, char *line) {
+    char *args = line + 2;
+    int v[4];
+    float f[8];
+    server->lines_in++;
+    if (!line[0] || line[1] != ',') {
+        return;
+    }
+    switch (line[0]) {
+        case 'V':
+            if (atoi(args) == PROTOCOL_BINARY && server->binary && !c->binary) {
+                queue_text(server, c, "V,2\n");
+                c->binary = 1;
+            }
+            break;
+        case 'C':
+            v[2] = 0;
+            if (sscanf(args, "%d,%d,%d", v, v + 1, v + 2) >= 2) {
+                on_chunk(server, c, v[0], v[1], v[2]);
+            }
+            break;
+        case 'B':
+            if (sscanf(args, "%d,%d,%d,%d", v, v + 1, v + 2, v + 3) == 4) {
+                on_block(server, v[0], v[1], v[2], v[3]);
+            }
+            break;
+        case 'P':
+            {
+                int count = sscanf(args, "%f,%f,%f,%f,%f,%f,%f,%f",
+                    f, f + 1, f + 2, f + 3, f + 4, f + 5, f + 6, f + 7);
+                if (count >= 5) {
+                    on_position(server, c, f, count);
+                }
+            }
+            break;
+        case PING:
+            {
+                char echo[128];
+                snprintf(echo, sizeof(echo), "%s\n", line);
+                queue_text(server, c, echo);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void on_connect(Server *server, int sd) {
+    Connection *c;
+    char line[128];
+    int flag = 1;
+    if (server->connection_count == MAX_CONNECTIONS) {
+        close(sd);
+        return;
+    }
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+    c = server->connections + server->connection_count++;
+    memset(c, 0, sizeof(Connection));
+    c->sd = sd;
+    c->id = ++server->next_id;
+    snprintf(line, sizeof(line), "U,%d,0,32,0,0,0\n", c->id);
+    queue_text(server, c, line);
+}
+
+static void on_disconnect(Server *server, int index) {
+    Connection *c = server->connections + index;
+    char line[64];
+    int id = c->id;
+    int i;
+    close(c->sd);
+    free(c->in.data);
+    free(c->out.data);
+    *c = server->connections[--server->connection_count];
+    snprintf(line, sizeof(line), "D,%d\n", id);
+    for (i = 0; i < server->connection_count; i++) {
+        Connection *other = server->connections + i;
+        if (other->binary) {
+            char data[4];
+            put_int(data, id);
+            queue_frame(server, other, 'D', data, 4);
+        }
+        else {
+            queue_text(server, other, line);
+        }
+    }
+}
+
+/* returns 0 when the connection is gone */
+static int receive(Server *server, Connection *c) {
+    char data[BUFFER_SIZE];
+    int n, start = 0, i;
+    while ((n = recv(c->sd, data, sizeof(data), 0)) > 0) {
+        buffer_append(&c->in, data, n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return 0;
+    }
+    for (i = 0; i < c->in.length; i++) {
+        if (c->in.data[i] == '\n') {
+            c->in.data[i] = '\0';
+            on_line(server, c, c->in.data + start);
+            start = i + 1;
+        }
+    }
+    buffer_consume(&c->in, start);
+    return 1;
+}
+
+static int flush(Server *server, Connection *c) {
+    int sent = 0;
+    while (sent < c->out.length) {
+        int n = send(c->sd, c->out.data + sent, c->out.length - sent, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return 0;
+        }
+        server->sends++;
+        sent += n;
+    }
+    buffer_consume(&c->out, sent);
+    return 1;
+}
+
+static int server_run(void *arg) {
+    Server *server = (Server *)arg;
+    struct pollfd fds[MAX_CONNECTIONS + 1];
+    while (!stopping) {
+        int count = server->connection_count;
+        int i;
+        fds[0].fd = server->listener;
+        fds[0].events = POLLIN;
+        for (i = 0; i < count; i++) {
+            fds[i + 1].fd = server->connections[i].sd;
+            fds[i + 1].events = POLLIN;
+            if (server->connections[i].out.length) {
+                fds[i + 1].events |= POLLOUT;
+            }
+        }
+        if (poll(fds, count + 1, 10) <= 0) {
+            continue;
+        }
+        for (i = count - 1; i >= 0; i--) {
+            Connection *c = server->connections + i;
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!receive(server, c)) {
+                    on_disconnect(server, i);
+                }
+            }
+        }
+        /* everything queued while reading goes out in as few writes as
+           the socket buffers allow */
+        for (i = server->connection_count - 1; i >= 0; i--) {
+            if (!flush(server, server->connections + i)) {
+                on_disconnect(server, i);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int sd = accept(server->listener, NULL, NULL);
+            if (sd >= 0) {
+                on_connect(server, sd);
+            }
+        }
+    }
+    return 0;
+}
+
+static int server_listen(Server *server) {
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    int flag = 1;
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener < 0) {
+        return -1;
+    }
+    setsockopt(server->listener, SOL_SOCKET, SO_REUSEADDR,
+        (char *)&flag, sizeof(flag));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    if (bind(server->listener, (struct sockaddr *)&address, sizeof(address)) ||
+        listen(server->listener, MAX_CONNECTIONS) ||
+        getsockname(server->listener, (struct sockaddr *)&address, &size))
+    {
+        return -1;
+    }
+    server->port = ntohs(address.sin_port);
+    return 0;
+}
+
+/* headless bots: walk, build, and throw away what they receive */
+
+static void request_chunks(int sd, int radius) {
+    int size = (2 * radius + 1) * (2 * radius + 1) * 32;
+    char *buffer = malloc(size);
+    int length = 0, p, q;
+    for (p = -radius; p <= radius; p++) {
+        for (q = -radius; q <= radius; q++) {
+            length += sprintf(buffer + length, "C,%d,%d,0\n", p, q);
+        }
+    }
+    send_all(sd, buffer, length);
+    free(buffer);
+}
+
+static int bot_run(void *arg) {
+    Bot *bot = (Bot *)arg;
+    char buffer[BUFFER_SIZE];
+    struct pollfd pfd;
+    unsigned int seed = 1 + bot->index * 7919;
+    float x, z, angle;
+    int sd = connect_local(bot->port);
+    int tick = 0;
+    x = (float)(rand_r(&seed) % (2 * SPAWN_RANGE) - SPAWN_RANGE);
+    z = (float)(rand_r(&seed) % (2 * SPAWN_RANGE) - SPAWN_RANGE);
+    angle = (rand_r(&seed) % 628) / 100.0f;
+    send_all(sd, "V,1\n", 4);
+    request_chunks(sd, bot->radius);
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+    while (!stopping) {
+        char line[128];
+        int length;
+        while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+            int n = recv(sd, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                close(sd);
+                return 0;
+            }
+            bot->bytes_received += n;
+        }
+        angle += ((rand_r(&seed) % 100) - 50) / 200.0f;
+        x += cosf(angle) * WALK_SPEED * TICK;
+        z += sinf(angle) * WALK_SPEED * TICK;
+        if (fabsf(x) > SPAWN_RANGE || fabsf(z) > SPAWN_RANGE) {
+            angle += PI;
+        }
+        length = snprintf(line, sizeof(line), "P,%.2f,%.2f,%.2f,%.2f,0.00\n",
+            x, 12.0f, z, angle);
+        if (++tick % BUILD_EVERY == 0) {
+            length += snprintf(line + length, sizeof(line) - length,
+                "B,%d,%d,%d,%d\n", (int)roundf(x), 11 + tick % 8,
+                (int)roundf(z), 1 + tick % 20);
+            bot->lines_sent++;
+        }
+        bot->lines_sent++;
+        if (send_all(sd, line, length)) {
+            break;
+        }
+        sleep_for(TICK);
+    }
+    close(sd);
+    return 0;
+}
+
+/* the measured client: client.c plus the parsing main.c does */
+
+typedef struct {
+    unsigned long messages;
+    unsigned long bytes;
+    unsigned long blocks;
+    unsigned long positions;
+    unsigned long chunks;
+    unsigned long checksum;
+    double parse_time;
+} Load;
+
+static void count_message(Load *load, const ClientMessage *message) {
+    Message m;
+    int i;
+    load->messages++;
+    load->bytes += message->length;
+    if (!message->binary || message->type == FRAME_TEXT) {
+        /* C,p,q closes a chunk request; the game itself ignores it */
+        if (message->data[0] == 'C' && message->data[1] == ',') {
+            load->chunks++;
+            return;
+        }
+        if (message->binary) {
+            char line[1024];
+            int length = MIN(message->length, (int)sizeof(line) - 1);
+            memcpy(line, message->data, length);
+            line[length] = '\0';
+            if (!protocol_parse_line(line, &m)) {
+                return;
+            }
+        }
+        else if (!protocol_parse_line(message->data, &m)) {
+            return;
+        }
+        load->checksum += m.type + m.ints[0];
+        load->blocks += m.type == 'B';
+        load->positions += m.type == 'P';
+        return;
+    }
+    switch (message->type) {
+        case 'B':
+            for (i = 8; i + FRAME_BLOCK <= message->length; i += FRAME_BLOCK) {
+                int x = client_read_short(message->data + i);
+                int y = client_read_short(message->data + i + 2);
+                int z = client_read_short(message->data + i + 4);
+                int w = client_read_short(message->data + i + 6);
+                load->checksum += x + y * 31 + z * 961 + w;
+                load->blocks++;
+            }
+            break;
+        case 'P':
+            if (message->length >= 24) {
+                load->checksum += client_read_int(message->data) +
+                    (int)client_read_float(message->data + 4);
+                load->positions++;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void drain(Load *load) {
+    ClientMessage message;
+    double start = perf_now();
+    int count = 0;
+    while (client_next(&message)) {
+        count_message(load, &message);
+        count++;
+    }
+    if (count) {
+        load->parse_time += perf_now() - start;
+    }
+}
+
+static void report(const char *name, const Load *load, double elapsed) {
+    printf("%-8s %8lu messages %8.0f/s %7.1f MB/s %6.1f ns/message "
+        "(%lu blocks, %lu positions, %lu chunks)\n",
+        name, load->messages, elapsed > 0 ? load->messages / elapsed : 0.0,
+        elapsed > 0 ? load->bytes / elapsed / 1e6 : 0.0,
+        load->messages ? load->parse_time * 1e9 / load->messages : 0.0,
+        load->blocks, load->positions, load->chunks);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: craft-loadgen [-c bots] [-s seconds] "
+        "[-r radius] [-k blocks] [-b]\n");
+}
+
+int main(int argc, char **argv) {
+    static Server server;
+    static Bot bots[MAX_BOTS];
+    thrd_t server_thread;
+    thrd_t threads[MAX_BOTS];
+    ClientStats stats;
+    Load join, steady;
+    int bot_count = 16;
+    int radius = 2;
+    int terrain = CHUNK_SIZE * CHUNK_SIZE;
+    int chunk_count, p, q, i;
+    unsigned long bot_bytes = 0, bot_lines = 0;
+    double seconds = 5;
+    double start, joined, last_position = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-b")) {
+            server.binary = 1;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc < 3) {
+            usage();
+            return 1;
+        }
+        if (!strcmp(argv[1], "-c")) {
+            bot_count = MAX(0, MIN(atoi(argv[2]), MAX_BOTS));
+        }
+        else if (!strcmp(argv[1], "-s")) {
+            seconds = atof(argv[2]);
+        }
+        else if (!strcmp(argv[1], "-r")) {
+            radius = MAX(0, MIN(atoi(argv[2]), 24));
+        }
+        else if (!strcmp(argv[1], "-k")) {
+            terrain = MAX(0, atoi(argv[2]));
+        }
+        else {
+            usage();
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 1) {
+        usage();
+        return 1;
+    }
+    server.terrain = terrain;
+    if (server_listen(&server)) {
+        perror("craft-loadgen: listen");
+        return 1;
+    }
+    thrd_create(&server_thread, server_run, &server);
+    for (i = 0; i < bot_count; i++) {
+        bots[i].index = i;
+        bots[i].port = server.port;
+        bots[i].radius = radius;
+        thrd_create(threads + i, bot_run, bots + i);
+    }
+    printf("%d bots, %d chunks of %d blocks each, %s protocol\n",
+        bot_count, (2 * radius + 1) * (2 * radius + 1), server.terrain,
+        server.binary ? "binary" : "text");
+
+    memset(&join, 0, sizeof(join));
+    memset(&steady, 0, sizeof(steady));
+    chunk_count = (2 * radius + 1) * (2 * radius + 1);
+    client_enable();
+    client_connect("127.0.0.1", server.port);
+    client_start();
+    client_version(PROTOCOL_BINARY);
+    start = perf_now();
+    for (p = -radius; p <= radius; p++) {
+        for (q = -radius; q <= radius; q++) {
+            client_chunk(p, q, 0, 0, 0);
+        }
+    }
+    client_flush();
+    while (join.chunks < (unsigned long)chunk_count &&
+        perf_now() - start < seconds)
+    {
+        drain(&join);
+        sleep_for(0.001);
+    }
+    joined = perf_now();
+    while (perf_now() - joined < seconds) {
+        double now = perf_now();
+        if (now - last_position > TICK) {
+            float t = (float)(now - joined);
+            last_position = now;
+            client_position(t * WALK_SPEED, 12, 0, 0, 0);
+            client_flush();
+        }
+        drain(&steady);
+        sleep_for(0.001);
+    }
+    client_get_stats(&stats);
+    stopping = 1;
+    for (i = 0; i < bot_count; i++) {
+        thrd_join(threads[i], NULL);
+        bot_bytes += bots[i].bytes_received;
+        bot_lines += bots[i].lines_sent;
+    }
+    client_stop();
+    client_disable();
+    thrd_join(server_thread, NULL);
+
+    report("join", &join, joined - start);
+    report("steady", &steady, perf_now() - joined);
+    printf("client queue max %d%%, %u stalls (%.1fms), %d bytes received\n",
+        (int)(100.0 * stats.max_fill / stats.capacity),
+        stats.stalls, stats.stall_time * 1000, stats.bytes_received);
+    printf("server %lu lines in, %lu messages out in %lu writes, %.1f MB\n",
+        server.lines_in, server.messages_out, server.sends,
+        server.bytes_out / 1e6);
+    printf("bots %lu lines sent, %.1f MB received\n",
+        bot_lines, bot_bytes / 1e6);
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/perf.h"
+#include "../src/protocol.h"
+#include "../src/sign.h"
+
+/* Replays a chunk burst through the text protocol parser, and through
+   the sscanf chain it replaced, and checks that both agree.
+
+   usage: craft-parsebench [-n rounds] [burst]
+
+   burst is a recording of what a server sends, for example
+   printf 'V,1\nC,0,0,0\nC,1,0,0\n' | nc host 4080 > burst.txt
+   Without one a burst of a few dense chunks is made up. */
+
+// as in renderer.h, which needs the GL headers
+#define MAX_NAME_LENGTH 32
+
+typedef struct {
+    unsigned long messages;
+    unsigned long checksum;
+} Result;
+
+static void add(Result *result, int type, const int *v, int count) {
+    int i;
+    result->messages++;
+    result->checksum = result->checksum * 31 + type;
+    for (i = 0; i < count; i++) {
+        result->checksum = result->checksum * 31 + (unsigned int)v[i];
+    }
+}
+
+static void add_floats(Result *result, const float *f, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        result->checksum = result->checksum * 31 + (int)(f[i] * 100);
+    }
+}
+
+static void parse_dispatch(char *line, Result *result) {
+    Message m;
+    if (!protocol_parse_line(line, &m)) {
+        return;
+    }
+    switch (m.type) {
+        case 'U': case 'P':
+            add(result, m.type, m.ints, 1);
+            add_floats(result, m.floats, 5);
+            break;
+        case 'B': case 'L': case 'S':
+            add(result, m.type, m.ints, 6);
+            break;
+        case 'D':
+            add(result, m.type, m.ints, 1);
+            break;
+        case 'K':
+            add(result, m.type, m.ints, 3);
+            break;
+        case 'R':
+            add(result, m.type, m.ints, 2);
+            break;
+        case 'N':
+            add(result, m.type, m.ints, 1);
+            break;
+        case 'E':
+            result->messages++;
+            break;
+        default:
+            break;
+    }
+}
+
+/* the previous parser: every format tried against every line */
+static void parse_sscanf(char *line, Result *result) {
+    int v[6];
+    float f[5];
+    char text[MAX_SIGN_LENGTH] = {0};
+    char name[MAX_NAME_LENGTH];
+    double elapsed;
+    int day_length;
+    char format[64];
+    if (sscanf(line, "U,%d,%f,%f,%f,%f,%f",
+        v, f, f + 1, f + 2, f + 3, f + 4) == 6) {
+        add(result, 'U', v, 1);
+        add_floats(result, f, 5);
+    }
+    if (sscanf(line, "B,%d,%d,%d,%d,%d,%d",
+        v, v + 1, v + 2, v + 3, v + 4, v + 5) == 6) {
+        add(result, 'B', v, 6);
+    }
+    if (sscanf(line, "L,%d,%d,%d,%d,%d,%d",
+        v, v + 1, v + 2, v + 3, v + 4, v + 5) == 6) {
+        add(result, 'L', v, 6);
+    }
+    if (sscanf(line, "P,%d,%f,%f,%f,%f,%f",
+        v, f, f + 1, f + 2, f + 3, f + 4) == 6) {
+        add(result, 'P', v, 1);
+        add_floats(result, f, 5);
+    }
+    if (sscanf(line, "D,%d", v) == 1) {
+        add(result, 'D', v, 1);
+    }
+    if (sscanf(line, "K,%d,%d,%d", v, v + 1, v + 2) == 3) {
+        add(result, 'K', v, 3);
+    }
+    if (sscanf(line, "R,%d,%d", v, v + 1) == 2) {
+        add(result, 'R', v, 2);
+    }
+    if (sscanf(line, "E,%lf,%d", &elapsed, &day_length) == 2) {
+        result->messages++;
+    }
+    snprintf(format, sizeof(format), "N,%%d,%%%ds", MAX_NAME_LENGTH - 1);
+    if (sscanf(line, format, v, name) == 2) {
+        add(result, 'N', v, 1);
+    }
+    snprintf(format, sizeof(format),
+        "S,%%d,%%d,%%d,%%d,%%d,%%d,%%%d[^\n]", MAX_SIGN_LENGTH - 1);
+    if (sscanf(line, format, v, v + 1, v + 2, v + 3, v + 4, v + 5, text) >= 6) {
+        add(result, 'S', v, 6);
+    }
+}
+
+static char *make_burst(size_t *size) {
+    size_t capacity = 1 << 20;
+    size_t length = 0;
+    char *data = malloc(capacity);
+    int p, q, x, y, z, i;
+    length += sprintf(data + length, "U,1,0,0,0,0,0\nE,1500000000.25,600\n");
+    for (p = -1; p <= 1; p++) {
+        for (q = -1; q <= 1; q++) {
+            for (i = 0; i < 2000; i++) {
+                if (length + 256 > capacity) {
+                    capacity *= 2;
+                    data = realloc(data, capacity);
+                }
+                x = p * 32 + i % 32;
+                z = q * 32 + (i / 32) % 32;
+                y = 12 + i / 1024;
+                length += sprintf(data + length, "B,%d,%d,%d,%d,%d,%d\n",
+                    p, q, x, y, z, 1 + i % 60);
+                if (i % 250 == 0) {
+                    length += sprintf(data + length,
+                        "P,2,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                        x + 0.5, y + 2.25, z - 0.75, 1.5, -0.25);
+                }
+            }
+            length += sprintf(data + length,
+                "L,%d,%d,%d,20,%d,15\nS,%d,%d,%d,20,%d,2,hello\n"
+                "K,%d,%d,%d\nR,%d,%d\nC,%d,%d\n",
+                p, q, p * 32, q * 32, p, q, p * 32, q * 32,
+                p, q, 1000 + p * 3 + q, p, q, p, q);
+        }
+    }
+    *size = length;
+    return data;
+}
+
+static char *load_burst(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    char *data;
+    long length;
+    if (!file) {
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = malloc(length + 1);
+    *size = fread(data, 1, length, file);
+    fclose(file);
+    return data;
+}
+
+static double replay(
+    const char *burst, size_t size, char *work, int rounds,
+    void (*parse)(char *, Result *), Result *result)
+{
+    double start = perf_now();
+    int i;
+    memset(result, 0, sizeof(Result));
+    for (i = 0; i < rounds; i++) {
+        char *line = work;
+        char *end = work + size;
+        memcpy(work, burst, size);
+        while (line < end) {
+            char *eol = memchr(line, '\n', end - line);
+            if (!eol) {
+                break;
+            }
+            *eol = '\0';
+            parse(line, result);
+            line = eol + 1;
+        }
+    }
+    return perf_now() - start;
+}
+
+int main(int argc, char **argv) {
+    Result a, b;
+    double ta, tb;
+    int rounds = 20;
+    size_t size, lines = 0, i;
+    char *burst, *work;
+    while (argc > 2 && !strcmp(argv[1], "-n")) {
+        rounds = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1) {
+        burst = load_burst(argv[1], &size);
+        if (!burst) {
+            fprintf(stderr, "craft-parsebench: cannot read %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else {
+        burst = make_burst(&size);
+    }
+    for (i = 0; i < size; i++) {
+        lines += burst[i] == '\n';
+    }
+    work = malloc(size + 1);
+    ta = replay(burst, size, work, rounds, parse_sscanf, &a);
+    tb = replay(burst, size, work, rounds, parse_dispatch, &b);
+    printf("%lu lines, %lu bytes, %d rounds\n",
+        (unsigned long)lines, (unsigned long)size, rounds);
+    printf("sscanf:   %8.1f ns/line\n", ta * 1e9 / (lines * rounds));
+    printf("dispatch: %8.1f ns/line (%.1fx)\n",
+        tb * 1e9 / (lines * rounds), tb > 0 ? ta / tb : 0.0);
+    if (a.messages != b.messages || a.checksum != b.checksum) {
+        printf("MISMATCH: %lu vs %lu messages\n", a.messages, b.messages);
+        return 1;
+    }
+    printf("%lu messages, results match\n", b.messages / rounds);
+    return 0;
+}
@@ -0,0 +1,198 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "../src/config.h"
+#include "../src/db.h"
+#include "../src/map.h"
+#include "../src/perf.h"
+#include "../src/util.h"
+#include "../src/world.h"
+#include "tinycthread.h"
+
+/* Pregenerates the terrain of a rectangle of chunks into a world database,
+   so the client loads it instead of running world generation.
+
+   usage: craft-pregen [-t threads] [-b sqlite|region] [-f] db p0 q0 p1 q1
+
+   -f creates a new world with the interpolated (fast) terrain noise. A
+   world that already has a terrain mode keeps it. Chunks of an existing
+   world keep the blocks players changed in them. */
+
+#define MAX_THREADS 64
+
+typedef struct {
+    int p0;
+    int q0;
+    int width;
+    int count;
+    int next;
+    int done;
+    unsigned long blocks;
+    mtx_t mtx;
+} Job;
+
+static int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#else
+    return 1;
+#endif
+}
+
+static void map_set_func(int x, int y, int z, int w, void *arg) {
+    Map *map = (Map *)arg;
+    map_set(map, x, y, z, w);
+}
+
+static void map_fill_func(int x, int z, int y0, int y1, int w, void *arg) {
+    Map *map = (Map *)arg;
+    map_fill(map, x, z, y0, y1, w);
+}
+
+static int pregen_run(void *arg) {
+    Job *job = (Job *)arg;
+    while (1) {
+        int index, p, q;
+        Map map;
+        mtx_lock(&job->mtx);
+        index = job->next++;
+        mtx_unlock(&job->mtx);
+        if (index >= job->count) {
+            break;
+        }
+        p = job->p0 + index % job->width;
+        q = job->q0 + index / job->width;
+        if (db_get_generated(p, q)) {
+            continue;
+        }
+        map_alloc(&map, p * CHUNK_SIZE - 1, 0, q * CHUNK_SIZE - 1, 0x7fff);
+        create_world_fill(p, q, map_set_func, map_fill_func, &map);
+        // blocks players placed or dug out win over the terrain
+        db_load_blocks(&map, p, q);
+        db_insert_chunk(p, q, &map);
+        mtx_lock(&job->mtx);
+        job->done++;
+        job->blocks += map.size;
+        if (job->done % 256 == 0) {
+            printf("%d / %d chunks\n", job->done, job->count);
+        }
+        mtx_unlock(&job->mtx);
+        map_free(&map);
+    }
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: craft-pregen [-t threads] [-b sqlite|region] [-f] "
+        "db p0 q0 p1 q1\n");
+}
+
+int main(int argc, char **argv) {
+    Job job;
+    WorldCacheStats cache_stats;
+    thrd_t threads[MAX_THREADS];
+    int thread_count = cpu_count();
+    int backend = DB_BACKEND_SQLITE;
+    int terrain = TERRAIN_EXACT;
+    int p0, q0, p1, q1, i;
+    double start, elapsed;
+    char *path;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-f")) {
+            terrain = TERRAIN_FAST;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc > 2 && !strcmp(argv[1], "-t")) {
+            thread_count = atoi(argv[2]);
+        }
+        else if (argc > 2 && !strcmp(argv[1], "-b")) {
+            if (!strcmp(argv[2], "region")) {
+                backend = DB_BACKEND_REGION;
+            }
+            else if (strcmp(argv[2], "sqlite")) {
+                usage();
+                return 1;
+            }
+        }
+        else {
+            usage();
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 6) {
+        usage();
+        return 1;
+    }
+    path = argv[1];
+    p0 = atoi(argv[2]);
+    q0 = atoi(argv[3]);
+    p1 = atoi(argv[4]);
+    q1 = atoi(argv[5]);
+    if (p1 < p0 || q1 < q0) {
+        usage();
+        return 1;
+    }
+    thread_count = MAX(1, MIN(thread_count, MAX_THREADS));
+    world_cache_init();
+    db_enable();
+    db_set_backend(backend);
+    db_set_durability(DB_DURABILITY_OFF);
+    if (db_init(path)) {
+        fprintf(stderr, "craft-pregen: cannot open %s\n", path);
+        return 1;
+    }
+    {
+        float x, y, z, rx, ry;
+        int existing = db_load_state(&x, &y, &z, &rx, &ry);
+        int trees = db_get_option("trees", !existing);
+        terrain = db_get_option(
+            "terrain", existing ? TERRAIN_EXACT : terrain);
+        db_set_option("terrain", terrain);
+        db_set_option("trees", trees);
+        world_set_terrain(terrain);
+        world_set_structures(trees);
+    }
+    memset(&job, 0, sizeof(job));
+    job.p0 = p0;
+    job.q0 = q0;
+    job.width = p1 - p0 + 1;
+    job.count = job.width * (q1 - q0 + 1);
+    mtx_init(&job.mtx, mtx_plain);
+    printf("generating %d chunks on %d threads\n", job.count, thread_count);
+    start = perf_now();
+    for (i = 0; i < thread_count; i++) {
+        thrd_create(threads + i, pregen_run, &job);
+    }
+    for (i = 0; i < thread_count; i++) {
+        thrd_join(threads[i], NULL);
+    }
+    elapsed = perf_now() - start;
+    db_close();
+    mtx_destroy(&job.mtx);
+    printf("%d chunks, %lu blocks in %.2fs: %.1f chunks/sec\n",
+        job.done, job.blocks, elapsed,
+        elapsed > 0 ? job.done / elapsed : 0.0);
+    world_cache_stats(&cache_stats);
+    printf("noise cache: %u column hits, %u misses\n",
+        cache_stats.hits, cache_stats.misses);
+    return 0;
+}
@@ -1,5 +1,6 @@
-# gcc -std=c99 -O3 -shared -o world \
-#   -I src -I deps/noise deps/noise/noise.c src/world.c
+# gcc -std=c99 -O3 -shared -fPIC -o world \
+#   -I src -I deps/noise -I deps/tinycthread \
+#   deps/noise/noise.c deps/tinycthread/tinycthread.c src/world.c -lpthread
 
 from ctypes import CDLL, CFUNCTYPE, c_float, c_int, c_void_p
 from collections import OrderedDict